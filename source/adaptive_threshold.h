@@ -0,0 +1,110 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cmath>
+#include "profiler.h"
+
+using namespace cv;
+
+// Local (adaptive) thresholding for scans with uneven illumination. Every
+// pixel is compared with a threshold derived from the mean (and standard
+// deviation) of the window around it. Window sums come from integral images of
+// the values and of the squared values, so a pixel costs the same whatever the
+// window size. The image is processed in parallel bands of rows, each band
+// builds the integral images of just the rows its windows cover.
+
+// Thresholding modes
+enum class ThresholdMode {
+  GLOBAL,   // One threshold for the whole image
+  MEAN,     // Local mean scaled by (1 - k) (Bradley)
+  SAUVOLA   // Local mean and standard deviation (Sauvola)
+};
+
+// Dynamic range of the standard deviation used by Sauvola's method
+static const double kSauvolaRange = 128.0;
+
+// Parse a thresholding mode (global, mean or sauvola), returns false if unknown
+static bool ParseThresholdMode(const String& name, ThresholdMode* out_mode) {
+  if (name == "global") { *out_mode = ThresholdMode::GLOBAL; return true; }
+  if (name == "mean") { *out_mode = ThresholdMode::MEAN; return true; }
+  if (name == "sauvola") { *out_mode = ThresholdMode::SAUVOLA; return true; }
+  return false;
+}
+
+// Threshold a span of a row, [x_begin, x_end). Window sums are read from the
+// integral rows at x - half (left) and x + half + 1 (right), clamped to the
+// image. The unclamped spans (the bulk of each row) have no branches in the
+// loop and are vectorized by the compiler.
+template<bool kSauvola, bool kClamped>
+static void AdaptiveThresholdSpan(const uchar* src, const double* s0, const double* s1, const double* q0, const double* q1, int x_begin, int x_end, int width, int half, int window_rows, double k, uchar* dst) {
+  const double inv_area = 1.0 / ((double)window_rows * (2 * half + 1));
+  for (int x = x_begin; x < x_end; x++) {
+    int left = kClamped ? std::max(x - half, 0) : x - half;
+    int right = kClamped ? std::min(x + half + 1, width) : x + half + 1;
+    double scale = kClamped ? 1.0 / ((double)window_rows * (right - left)) : inv_area;
+    double mean = (s1[right] - s0[right] - s1[left] + s0[left]) * scale;
+    double t;
+    if (kSauvola) {
+      double variance = (q1[right] - q0[right] - q1[left] + q0[left]) * scale - mean * mean;
+      t = mean * (1.0 + k * (std::sqrt(std::max(variance, 0.0)) / kSauvolaRange - 1.0));
+    } else {
+      t = mean * (1.0 - k);
+    }
+    dst[x] = src[x] > t ? 255 : 0;
+  }
+}
+
+// Threshold the rows [y_begin, y_end) of an image
+template<bool kSauvola>
+static void AdaptiveThresholdBand(const Mat& image, int y_begin, int y_end, int half, double k, Mat* out_mask) {
+  thread_local Mat sums;
+  thread_local Mat square_sums;
+  int top = std::max(y_begin - half, 0);
+  int bottom = std::min(y_end + half, image.rows);
+  integral(image.rowRange(top, bottom), sums, square_sums, CV_64F, CV_64F);
+
+  int width = image.cols;
+  int x_middle_begin = std::min(half, width);
+  int x_middle_end = std::max(width - half, x_middle_begin);
+  for (int y = y_begin; y < y_end; y++) {
+    int r0 = std::max(y - half, 0) - top;
+    int r1 = std::min(y + half + 1, image.rows) - top;
+    const double* s0 = sums.ptr<double>(r0);
+    const double* s1 = sums.ptr<double>(r1);
+    const double* q0 = square_sums.ptr<double>(r0);
+    const double* q1 = square_sums.ptr<double>(r1);
+    const uchar* src = image.ptr<uchar>(y);
+    uchar* dst = out_mask->ptr<uchar>(y);
+    AdaptiveThresholdSpan<kSauvola, true>(src, s0, s1, q0, q1, 0, x_middle_begin, width, half, r1 - r0, k, dst);
+    AdaptiveThresholdSpan<kSauvola, false>(src, s0, s1, q0, q1, x_middle_begin, x_middle_end, width, half, r1 - r0, k, dst);
+    AdaptiveThresholdSpan<kSauvola, true>(src, s0, s1, q0, q1, x_middle_end, width, width, half, r1 - r0, k, dst);
+  }
+}
+
+// Perform local thresholding of an 8-bit grayscale image with a square window
+// (an odd number of pixels wide). Background pixels become 255, characters 0,
+// as with global thresholding.
+static void PerformAdaptiveThresholding(const Mat& image, ThresholdMode mode, int window_size, double k, Mat* out_threshold_mask) {
+  CV_Assert(image.type() == CV_8UC1 && mode != ThresholdMode::GLOBAL);
+  ProfileScope scope("PerformAdaptiveThresholding");
+  Profiler::Instance().Count(ProfileCounter::PIXELS, image.total());
+  int half = std::max(window_size, 3) / 2;
+  out_threshold_mask->create(image.size(), CV_8U);
+  Mat& mask = *out_threshold_mask;
+
+  // Bands are several windows high so the rows shared with the neighbouring
+  // bands are a small part of each integral image
+  int band_rows = std::max(4 * (2 * half + 1), 128);
+  int num_bands = (image.rows + band_rows - 1) / band_rows;
+  parallel_for_(Range(0, num_bands), [&](const Range& range) {
+    for (int band = range.start; band < range.end; band++) {
+      int y_begin = band * band_rows;
+      int y_end = std::min(y_begin + band_rows, image.rows);
+      if (mode == ThresholdMode::SAUVOLA) {
+        AdaptiveThresholdBand<true>(image, y_begin, y_end, half, k, &mask);
+      } else {
+        AdaptiveThresholdBand<false>(image, y_begin, y_end, half, k, &mask);
+      }
+    }
+  });
+}
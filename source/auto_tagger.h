@@ -0,0 +1,107 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <vector>
+#include "segment_table.h"
+
+using namespace cv;
+
+// Automatic pre-tagging of segments. Simple shape features, relative to the
+// typical character of the page, separate the obvious cases: specks are
+// NOISE, blobs as high as a character but several characters wide are MERGED,
+// shapes close to the typical character are CORRECT. Every auto-tag comes with
+// a confidence in [0, 1], the segments below a confidence threshold are left
+// for the operator.
+
+// Per-segment features, stored column-wise like the segment table
+struct SegmentFeatures {
+  std::vector<float> relative_area;    // Area / median area
+  std::vector<float> relative_width;   // Width / median height
+  std::vector<float> relative_height;  // Height / median height (line height)
+  std::vector<float> fill_ratio;       // Area / bounding rectangle area
+};
+
+// Median of a copy of the values (0 if there are none)
+static float MedianOf(std::vector<float> values) {
+  if (values.empty()) { return 0; }
+  std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+  return values[values.size() / 2];
+}
+
+// Compute the features of all segments. Each feature is one loop over plain
+// float columns, so the compiler can vectorize them.
+static void ComputeSegmentFeatures(const SegmentTable& segments, SegmentFeatures* out_features) {
+  int n = segments.Size();
+  std::vector<float> areas(n);
+  std::vector<float> widths(n);
+  std::vector<float> heights(n);
+  for (int i = 0; i < n; i++) {
+    areas[i] = (float)segments.areas[i];
+    widths[i] = (float)segments.bounding_rectangles[i].width;
+    heights[i] = (float)segments.bounding_rectangles[i].height;
+  }
+  float inv_median_area = 1.0f / std::max(MedianOf(areas), 1.0f);
+  float inv_median_height = 1.0f / std::max(MedianOf(heights), 1.0f);
+
+  out_features->relative_area.resize(n);
+  out_features->relative_width.resize(n);
+  out_features->relative_height.resize(n);
+  out_features->fill_ratio.resize(n);
+  float* relative_area = out_features->relative_area.data();
+  float* relative_width = out_features->relative_width.data();
+  float* relative_height = out_features->relative_height.data();
+  float* fill_ratio = out_features->fill_ratio.data();
+  for (int i = 0; i < n; i++) { relative_area[i] = areas[i] * inv_median_area; }
+  for (int i = 0; i < n; i++) { relative_width[i] = widths[i] * inv_median_height; }
+  for (int i = 0; i < n; i++) { relative_height[i] = heights[i] * inv_median_height; }
+  for (int i = 0; i < n; i++) { fill_ratio[i] = areas[i] / (widths[i] * heights[i]); }
+}
+
+// How well a value lies inside [lower, upper]: 1 in the middle of the range,
+// falling linearly to 0 at its bounds
+static float RangeConfidence(float value, float lower, float upper) {
+  float half = 0.5f * (upper - lower);
+  return std::max(0.0f, std::min(value - lower, upper - value) / half);
+}
+
+// How far a value lies below a limit: 0 at the limit, 1 at zero
+static float BelowConfidence(float value, float limit) {
+  return std::max(0.0f, 1.0f - value / limit);
+}
+
+// Assign a tag and a confidence to every segment. Segments that match none
+// of the rules stay UNTAGGED with confidence 0.
+static void AutoTagSegments(const SegmentTable& segments, std::vector<Tag>* out_tags, std::vector<float>* out_confidences) {
+  SegmentFeatures features;
+  ComputeSegmentFeatures(segments, &features);
+  int n = segments.Size();
+  out_tags->assign(n, Tag::UNTAGGED);
+  out_confidences->assign(n, 0.0f);
+  for (int i = 0; i < n; i++) {
+    float relative_area = features.relative_area[i];
+    float relative_width = features.relative_width[i];
+    float relative_height = features.relative_height[i];
+    float fill_ratio = features.fill_ratio[i];
+
+    // Specks: a small fraction of a character in area and height
+    float noise = std::min(BelowConfidence(relative_area, 0.08f), BelowConfidence(relative_height, 0.3f));
+
+    // Merged characters: about a line high and much wider than a character
+    float merged = std::min(RangeConfidence(relative_height, 0.5f, 1.6f), std::min(1.0f, std::max(0.0f, relative_width - 1.6f)));
+
+    // Single characters: close to the median in height, width and area
+    float correct = std::min(std::min(RangeConfidence(relative_height, 0.55f, 1.45f), RangeConfidence(relative_width, 0.1f, 1.5f)),
+                             std::min(RangeConfidence(relative_area, 0.2f, 2.2f), RangeConfidence(fill_ratio, 0.1f, 0.95f)));
+
+    if (noise > 0 && noise >= merged && noise >= correct) {
+      (*out_tags)[i] = Tag::NOISE;
+      (*out_confidences)[i] = noise;
+    } else if (merged > 0 && merged >= correct) {
+      (*out_tags)[i] = Tag::MERGED;
+      (*out_confidences)[i] = merged;
+    } else if (correct > 0) {
+      (*out_tags)[i] = Tag::CORRECT;
+      (*out_confidences)[i] = correct;
+    }
+  }
+}
@@ -0,0 +1,375 @@
+#include "opencv2/opencv.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include "adaptive_threshold.h"
+#include "glyph_dedup.h"
+#include "segment_exporter.h"
+#include "segment_preview.h"
+#include "segmentation.h"
+#include "synthetic_page.h"
+
+using namespace cv;
+
+// Settings used for benchmarking
+struct BenchmarkSettings {
+  String input_image_file;
+  String suite;
+  int threshold;
+  int threshold_window_size;
+  float threshold_k;
+  uint min_segment_area;
+  int iterations;
+  bool synthetic;
+  std::vector<double> page_sizes;
+  SyntheticPageSettings page;
+  String results_file;
+};
+
+// Parse the command line arguments
+static bool ParseCommandLineArguments(int argc, char* argv[], BenchmarkSettings* out_settings) {
+  const String clp_keys =
+    "{help h ? usage | | show help on the command line arguments}"
+    "{@image | input/sample.jpg | image used as benchmark input}"
+    "{suite | all | benchmark suite to run (all, threshold, segmentation, pipeline, sort)}"
+    "{synthetic | | benchmark synthetic pages instead of the input image}"
+    "{page-sizes | 1,10,50,200 | sizes of the synthetic pages (megapixels)}"
+    "{glyph-height | 32 | glyph height of the synthetic pages (pixels)}"
+    "{glyph-density | 0.8 | fraction of glyph positions holding a glyph}"
+    "{noise-rate | 50 | noise specks per megapixel}"
+    "{touching-rate | 0.05 | fraction of glyphs touching the next glyph}"
+    "{illumination | 0.15 | darkening across the page (0 to 1)}"
+    "{seed | 24301 | seed of the synthetic pages}"
+    "{results | | also write the results as CSV to this file}"
+    "{threshold | 192 | threshold separating characters from the background}"
+    "{threshold-window | 51 | window size of local thresholding (pixels)}"
+    "{threshold-k | 0.2 | sensitivity of local thresholding}"
+    "{min-area | 20 | min area of a detected character}"
+    "{iterations | 10 | number of timed iterations per benchmark}"
+    ;
+
+  // Show help if requested
+  CommandLineParser clp(argc, argv, clp_keys);
+  if (clp.has("help")) {
+    clp.printMessage();
+    return false;
+  }
+
+  // Parse arguments
+  out_settings->input_image_file = clp.get<String>("@image");
+  out_settings->suite = clp.get<String>("suite");
+  out_settings->threshold = clp.get<int>("threshold");
+  out_settings->threshold_window_size = clp.get<int>("threshold-window");
+  out_settings->threshold_k = clp.get<float>("threshold-k");
+  out_settings->min_segment_area = clp.get<uint>("min-area");
+  out_settings->iterations = clp.get<int>("iterations");
+  out_settings->synthetic = clp.has("synthetic");
+  String page_sizes = clp.get<String>("page-sizes");
+  out_settings->page.glyph_height = clp.get<int>("glyph-height");
+  out_settings->page.glyph_density = clp.get<float>("glyph-density");
+  out_settings->page.noise_rate = clp.get<float>("noise-rate");
+  out_settings->page.touching_rate = clp.get<float>("touching-rate");
+  out_settings->page.illumination = clp.get<float>("illumination");
+  out_settings->page.seed = (uint64)clp.get<double>("seed");
+  out_settings->results_file = clp.get<String>("results");
+
+  // Show errors if any occurred
+  if (!clp.check()) {
+    clp.printErrors();
+    return false;
+  }
+  std::stringstream ss_page_sizes(page_sizes);
+  String page_size;
+  out_settings->page_sizes.clear();
+  while (std::getline(ss_page_sizes, page_size, ',')) {
+    double megapixels = std::atof(page_size.c_str());
+    if (megapixels <= 0) {
+      std::cout << "ERROR: invalid page size '" << page_size << "'." << std::endl;
+      return false;
+    }
+    out_settings->page_sizes.push_back(megapixels);
+  }
+  return true;
+}
+
+// A benchmark result, kept for the machine-readable output
+struct BenchmarkResult {
+  String input;
+  String suite;
+  String name;
+  double milliseconds;
+  size_t pixels;
+  size_t elements;
+  size_t items;
+};
+
+// Results of the run, and the input and suite being measured
+static std::vector<BenchmarkResult> benchmark_results;
+static String benchmark_input;
+static String benchmark_suite;
+
+// Write the results as CSV, one line per benchmark
+static bool WriteResults(const String& path) {
+  std::ofstream file(path);
+  if (!file) { return false; }
+  file << "input,suite,benchmark,milliseconds,pixels,elements,items" << std::endl;
+  file << std::setprecision(6);
+  for (const BenchmarkResult& result : benchmark_results) {
+    file << "\"" << result.input << "\"," << result.suite << ",\"" << result.name << "\"," << result.milliseconds << ","
+         << result.pixels << "," << result.elements << "," << result.items << std::endl;
+  }
+  return (bool)file;
+}
+
+// Run a function a number of times and return the mean duration in ms (after
+// one untimed warm-up run)
+template<typename F>
+static double MeasureMilliseconds(int iterations, F function) {
+  function();
+  int64 start = getTickCount();
+  for (int i = 0; i < iterations; i++) { function(); }
+  return (getTickCount() - start) * 1000.0 / getTickFrequency() / iterations;
+}
+
+// Print a benchmark result line (the segment count is left out for benchmarks
+// that do not produce segments)
+static void PrintResult(const String& name, double milliseconds, size_t pixels, size_t items = 0) {
+  std::cout << "   " << std::left << std::setw(40) << name << std::right
+            << std::setw(10) << std::fixed << std::setprecision(2) << milliseconds << " ms"
+            << std::setw(10) << pixels / milliseconds / 1e3 << " MP/s";
+  if (items > 0) { std::cout << std::setw(10) << items << " segments"; }
+  std::cout << std::endl;
+  benchmark_results.push_back({ benchmark_input, benchmark_suite, name, milliseconds, pixels, 0, items });
+}
+
+// Print a benchmark result line for a run over a number of elements
+static void PrintElementsResult(const String& name, double milliseconds, size_t elements) {
+  std::cout << "   " << std::left << std::setw(40) << name << std::right
+            << std::setw(10) << std::fixed << std::setprecision(2) << milliseconds << " ms"
+            << std::setw(10) << elements / milliseconds / 1e3 << " M/s" << std::endl;
+  benchmark_results.push_back({ benchmark_input, benchmark_suite, name, milliseconds, 0, elements, 0 });
+}
+
+// Segmentation as it was done before the connected-components engine: invert
+// the mask, find contours, then walk them for area and bounding rectangle
+static void PerformSegmentationFindContours(const Mat& image_thresholded, uint min_area, std::vector<std::vector<Point>>* out_contours, std::vector<uint>* out_areas, std::vector<Rect>* out_bounding_rectangles) {
+  out_contours->clear();
+  out_areas->clear();
+  out_bounding_rectangles->clear();
+  Mat image_thresholded_inverted = 255 - image_thresholded;
+  findContours(image_thresholded_inverted, *out_contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+  for (int i = 0; i < out_contours->size(); i++) {
+    out_areas->push_back(contourArea(out_contours->at(i)));
+    out_bounding_rectangles->push_back(boundingRect(out_contours->at(i)));
+  }
+  auto p = sort_permutation(*out_areas, [](uint const& a, uint const& b) { return a > b; });
+  apply_permutation_in_place(p, *out_contours, *out_areas, *out_bounding_rectangles);
+  while (out_areas->size() > 0 && out_areas->back() < min_area) {
+    out_contours->pop_back();
+    out_areas->pop_back();
+    out_bounding_rectangles->pop_back();
+  }
+}
+
+// Benchmark global and local thresholding of a grayscale image
+static void RunThresholdSuite(const Mat& image, const BenchmarkSettings& settings) {
+  std::cout << ">> Thresholding (" << image.cols << "x" << image.rows << ", window " << settings.threshold_window_size << ")" << std::endl;
+  benchmark_suite = "threshold";
+  Mat mask;
+  double ms;
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformThresholding(image, settings.threshold, &mask); });
+  PrintResult("Global", ms, image.total());
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformThresholding(image, -1, &mask); });
+  PrintResult("Global (Otsu)", ms, image.total());
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformAdaptiveThresholding(image, ThresholdMode::MEAN, settings.threshold_window_size, settings.threshold_k, &mask); });
+  PrintResult("Local mean", ms, image.total());
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformAdaptiveThresholding(image, ThresholdMode::SAUVOLA, settings.threshold_window_size, settings.threshold_k, &mask); });
+  PrintResult("Local Sauvola", ms, image.total());
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { adaptiveThreshold(image, mask, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY, settings.threshold_window_size | 1, 10); });
+  PrintResult("cv::adaptiveThreshold (mean, reference)", ms, image.total());
+}
+
+// Benchmark the segmentation paths on a threshold mask
+static void RunSegmentationSuite(const Mat& mask, const BenchmarkSettings& settings) {
+  std::cout << ">> Segmentation (" << mask.cols << "x" << mask.rows << ")" << std::endl;
+  benchmark_suite = "segmentation";
+  std::vector<std::vector<Point>> contours;
+  std::vector<uint> areas;
+  std::vector<Rect> bounding_rectangles;
+  SegmentTable segments;
+  double ms;
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformSegmentationFindContours(mask, settings.min_segment_area, &contours, &areas, &bounding_rectangles); });
+  PrintResult("findContours (previous)", ms, mask.total(), contours.size());
+
+  ms = MeasureMilliseconds(settings.iterations, [&]() { PerformSegmentation(mask, settings.min_segment_area, &segments); });
+  PrintResult("PerformSegmentation", ms, mask.total(), segments.Size());
+
+  ConnectedComponents components;
+  ms = MeasureMilliseconds(settings.iterations, [&]() { LabelConnectedComponents(mask, &components); });
+  PrintResult("LabelConnectedComponents", ms, mask.total(), components.areas.size());
+
+  Mat labels;
+  ms = MeasureMilliseconds(settings.iterations, [&]() { LabelConnectedComponents(mask, &components, &labels); });
+  PrintResult("LabelConnectedComponents (+labels)", ms, mask.total(), components.areas.size());
+
+  // The mask stands in for the gray page, the count is the number of groups
+  std::vector<int> groups;
+  int num_groups = 0;
+  ms = MeasureMilliseconds(settings.iterations, [&]() { num_groups = GroupRepeatedGlyphs(mask, segments, 3, &groups); });
+  PrintResult("GroupRepeatedGlyphs", ms, mask.total(), num_groups);
+}
+
+// Benchmark building and applying sort permutations on segment-like columns
+// (areas, bounding rectangles and ids), sorted by descending area
+static void RunSortSuite(const BenchmarkSettings& settings) {
+  const size_t sizes[] = { 1000, 100000, 10000000 };
+  for (size_t n : sizes) {
+    std::cout << ">> Sort permutation (" << n << " elements)" << std::endl;
+    benchmark_suite = "sort";
+    RNG rng(0x5eed);
+    std::vector<uint> areas(n);
+    for (size_t i = 0; i < n; i++) { areas[i] = rng.uniform(20, 20000); }
+    std::vector<Rect> bounding_rectangles(n);
+    std::vector<int> ids(n);
+    std::vector<size_t> p;
+    int iterations = n >= 10000000 ? 1 : settings.iterations;
+    double ms;
+
+    ms = MeasureMilliseconds(iterations, [&]() { p = sort_permutation(areas, [](uint const& a, uint const& b) { return a > b; }); });
+    PrintElementsResult("sort_permutation (std::sort)", ms, n);
+
+    ms = MeasureMilliseconds(iterations, [&]() { p = sort_permutation(areas, std::greater<uint>()); });
+    PrintElementsResult("sort_permutation (radix)", ms, n);
+
+    // Applying a permutation changes the columns, so every run restores them
+    // first; the copy is timed separately and subtracted
+    std::vector<uint> areas_sorted;
+    std::vector<Rect> bounding_rectangles_sorted;
+    std::vector<int> ids_sorted;
+    auto reset = [&]() {
+      areas_sorted = areas;
+      bounding_rectangles_sorted = bounding_rectangles;
+      ids_sorted = ids;
+    };
+    double ms_reset = MeasureMilliseconds(iterations, reset);
+
+    ms = MeasureMilliseconds(iterations, [&]() {
+      reset();
+      apply_permutation_in_place(p, areas_sorted);
+      apply_permutation_in_place(p, bounding_rectangles_sorted);
+      apply_permutation_in_place(p, ids_sorted);
+    });
+    PrintElementsResult("apply_permutation (3 walks)", ms - ms_reset, n);
+
+    ms = MeasureMilliseconds(iterations, [&]() {
+      reset();
+      apply_permutation_in_place(p, areas_sorted, bounding_rectangles_sorted, ids_sorted);
+    });
+    PrintElementsResult("apply_permutation (1 walk)", ms - ms_reset, n);
+  }
+}
+
+// Benchmark the per-segment functions of the interactive pipeline on the
+// segments of a page: partitioning by tag, cropping and encoding segments for
+// export, and rendering tagging previews. Segments get random tags, the
+// per-segment functions run on an evenly spread sample of the segments.
+static void RunPipelineSuite(const Mat& image, const Mat& mask, const BenchmarkSettings& settings) {
+  SegmentTable segments;
+  PerformSegmentation(mask, settings.min_segment_area, &segments);
+  std::cout << ">> Pipeline (" << segments.Size() << " segments)" << std::endl;
+  benchmark_suite = "pipeline";
+  if (segments.Size() == 0) { return; }
+  RNG rng(0x5eed);
+  for (int i = 0; i < segments.Size(); i++) { segments.tags[i] = (Tag)rng.uniform(0, kNumTags); }
+  Mat image_3c;
+  cvtColor(image, image_3c, COLOR_GRAY2BGR);
+  std::vector<int> sample;
+  int num_samples = std::min(segments.Size(), 1000);
+  for (int i = 0; i < num_samples; i++) { sample.push_back((int)((int64)i * segments.Size() / num_samples)); }
+  double ms;
+
+  std::vector<std::vector<int>> partitions;
+  ms = MeasureMilliseconds(settings.iterations, [&]() { segments.PartitionByTag(&partitions); });
+  PrintElementsResult("SegmentTable::PartitionByTag", ms, segments.Size());
+
+  Mat output;
+  ms = MeasureMilliseconds(settings.iterations, [&]() {
+    for (int id : sample) { RenderSegment(image_3c, { segments.contours[id] }, segments.bounding_rectangles[id], 2, &output); }
+  });
+  PrintElementsResult("RenderSegment", ms, sample.size());
+
+  std::vector<uchar> bytes;
+  ms = MeasureMilliseconds(settings.iterations, [&]() {
+    for (int id : sample) {
+      RenderSegment(image_3c, { segments.contours[id] }, segments.bounding_rectangles[id], 2, &output);
+      imencode(".jpg", output, bytes);
+    }
+  });
+  PrintElementsResult("RenderSegment + imencode (jpg)", ms, sample.size());
+
+  Mat preview;
+  Mat preview_contour;
+  ms = MeasureMilliseconds(settings.iterations, [&]() {
+    for (int id : sample) { GeneratePreview(image_3c, segments.contours[id], segments.bounding_rectangles[id], Scalar(255, 0, 0), 10.0f, &preview, &preview_contour); }
+  });
+  PrintElementsResult("GeneratePreview", ms, sample.size());
+}
+
+// Run the suites that work on an input page. Large pages get fewer
+// iterations, so a run over all page sizes takes minutes rather than hours.
+static void RunPageSuites(const String& input, const Mat& image, const BenchmarkSettings& settings) {
+  benchmark_input = input;
+  BenchmarkSettings page_settings = settings;
+  page_settings.iterations = std::max(1, std::min(settings.iterations, (int)(settings.iterations * 16e6 / image.total())));
+  Mat mask;
+  PerformThresholding(image, settings.threshold, &mask);
+  std::cout << ">> Input: " << input << " (" << image.cols << "x" << image.rows << ", " << page_settings.iterations << " iterations)" << std::endl;
+  if (settings.suite == "all" || settings.suite == "threshold") { RunThresholdSuite(image, page_settings); }
+  if (settings.suite == "all" || settings.suite == "segmentation") { RunSegmentationSuite(mask, page_settings); }
+  if (settings.suite == "all" || settings.suite == "pipeline") { RunPipelineSuite(image, mask, page_settings); }
+}
+
+// Run the benchmarks
+int main(int argc, char* argv[]) {
+  BenchmarkSettings settings;
+  if (!ParseCommandLineArguments(argc, argv, &settings)) { return 1; }
+
+  std::cout << "Benchmark" << std::endl;
+  std::cout << "================" << std::endl;
+  if (settings.synthetic) {
+    // Pages with the aspect ratio of A4
+    for (double megapixels : settings.page_sizes) {
+      SyntheticPageSettings page = settings.page;
+      int width = (int)std::sqrt(megapixels * 1e6 / 1.414);
+      page.size = Size(width, (int)(width * 1.414));
+      Mat image;
+      int num_glyphs = GenerateSyntheticPage(page, &image);
+      std::stringstream ss_input;
+      ss_input << "synthetic " << megapixels << " MP";
+      std::cout << ">> Generated " << ss_input.str() << " page with " << num_glyphs << " glyphs" << std::endl;
+      RunPageSuites(ss_input.str(), image, settings);
+    }
+  } else {
+    Mat image = imread(settings.input_image_file, IMREAD_GRAYSCALE);
+    if (image.empty()) {
+      std::cout << "ERROR: could not read image '" << settings.input_image_file << "'" << std::endl;
+      return 1;
+    }
+    RunPageSuites(settings.input_image_file, image, settings);
+  }
+  benchmark_input = "";
+  if (settings.suite == "all" || settings.suite == "sort") { RunSortSuite(settings); }
+
+  if (!settings.results_file.empty() && !WriteResults(settings.results_file)) {
+    std::cout << "ERROR: could not write results '" << settings.results_file << "'" << std::endl;
+    return 1;
+  }
+  return 0;
+}
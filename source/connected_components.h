@@ -0,0 +1,210 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <climits>
+#include <cstring>
+#include <vector>
+#include "contour_store.h"
+
+using namespace cv;
+
+// Connected component labeling of binary threshold masks. Characters are the
+// dark (zero) pixels of the mask, components are 8-connected. The mask is read
+// once, in place, as horizontal runs of foreground pixels which are joined with
+// the overlapping runs of the previous row using union-find. Areas, bounding
+// rectangles and (optionally) a label image all come out of that single scan,
+// contours are only traced on demand for the components that are kept.
+
+// Horizontal run of foreground pixels [x_begin, x_end) on row y
+struct PixelRun {
+  int y;
+  int x_begin;
+  int x_end;
+  int label;
+};
+
+// Connected components of a binary mask. The runs are grouped per component:
+// the runs of component i are runs[run_offsets[i]] .. runs[run_offsets[i + 1] - 1].
+struct ConnectedComponents {
+  std::vector<uint> areas;
+  std::vector<Rect> bounding_rectangles;
+  std::vector<PixelRun> runs;
+  std::vector<size_t> run_offsets;
+};
+
+// Find the root of a provisional label, compressing the path along the way
+static int FindRootLabel(std::vector<int>& parents, int label) {
+  int root = label;
+  while (parents[root] != root) { root = parents[root]; }
+  while (parents[label] != root) {
+    int next = parents[label];
+    parents[label] = root;
+    label = next;
+  }
+  return root;
+}
+
+// Join two provisional labels, the lowest label becomes the root
+static void UniteLabels(std::vector<int>& parents, int a, int b) {
+  a = FindRootLabel(parents, a);
+  b = FindRootLabel(parents, b);
+  if (a < b) { parents[b] = a; }
+  else if (b < a) { parents[a] = b; }
+}
+
+// Find the foreground (zero) runs on a row of the mask. Background is skipped
+// 8 pixels at a time, which makes the scan cheap on mostly white pages.
+static void FindRowRuns(const uchar* row, int cols, int y, std::vector<PixelRun>* out_runs) {
+  const uint64 ones = 0x0101010101010101ull;
+  const uint64 highs = 0x8080808080808080ull;
+  int x = 0;
+  while (x < cols) {
+    // Skip background words (no zero byte in them)
+    while (x + 8 <= cols) {
+      uint64 word;
+      std::memcpy(&word, row + x, 8);
+      if (((word - ones) & ~word & highs) != 0) { break; }
+      x += 8;
+    }
+    while (x < cols && row[x] != 0) { x++; }
+    if (x >= cols) { break; }
+
+    // Skip foreground words (all bytes zero)
+    int x_begin = x;
+    while (x + 8 <= cols) {
+      uint64 word;
+      std::memcpy(&word, row + x, 8);
+      if (word != 0) { break; }
+      x += 8;
+    }
+    while (x < cols && row[x] == 0) { x++; }
+    out_runs->push_back({ y, x_begin, x, 0 });
+  }
+}
+
+// Scratch buffers of the labeling. A caller that labels page after page (a
+// batch worker) can keep them, so they are reused instead of allocated again.
+struct LabelingScratch {
+  std::vector<PixelRun> runs;
+  std::vector<int> parents;
+  std::vector<int> components;
+  std::vector<int> x1, y1, x2, y2;
+  std::vector<size_t> fill;
+};
+
+// Label the 8-connected foreground components of a binary mask. Components are
+// numbered in raster order of their top-left run. If requested, a CV_32S label
+// image is produced as well (0 is background, component i has label i + 1).
+// Without scratch buffers, temporary ones are used.
+static void LabelConnectedComponents(const Mat& mask, ConnectedComponents* out_components, Mat* out_labels = nullptr, LabelingScratch* scratch_buffers = nullptr) {
+  CV_Assert(mask.type() == CV_8UC1);
+  LabelingScratch temporary;
+  LabelingScratch& scratch = scratch_buffers != nullptr ? *scratch_buffers : temporary;
+  std::vector<PixelRun>& runs = scratch.runs;
+  std::vector<int>& parents = scratch.parents;
+  runs.clear();
+  parents.clear();
+  runs.reserve(mask.rows * 4);
+
+  // Collect the runs and join them with the runs on the previous row
+  size_t previous_begin = 0;
+  size_t previous_end = 0;
+  for (int y = 0; y < mask.rows; y++) {
+    size_t current_begin = runs.size();
+    FindRowRuns(mask.ptr<uchar>(y), mask.cols, y, &runs);
+    size_t p = previous_begin;
+    for (size_t i = current_begin; i < runs.size(); i++) {
+      PixelRun& run = runs[i];
+      run.label = -1;
+
+      // Runs touch (8-connectivity) when they overlap with one pixel of slack
+      while (p < previous_end && runs[p].x_end < run.x_begin) { p++; }
+      for (size_t q = p; q < previous_end && runs[q].x_begin <= run.x_end; q++) {
+        if (run.label < 0) { run.label = runs[q].label; }
+        else { UniteLabels(parents, run.label, runs[q].label); }
+      }
+      if (run.label < 0) {
+        run.label = (int)parents.size();
+        parents.push_back(run.label);
+      }
+    }
+    previous_begin = current_begin;
+    previous_end = runs.size();
+  }
+
+  // Map the roots to consecutive component indices (in raster order)
+  std::vector<int>& components = scratch.components;
+  components.assign(parents.size(), -1);
+  int num_components = 0;
+  for (int label = 0; label < parents.size(); label++) {
+    int root = FindRootLabel(parents, label);
+    if (components[root] < 0) { components[root] = num_components++; }
+    components[label] = components[root];
+  }
+
+  // Accumulate the statistics and group the runs per component
+  out_components->areas.assign(num_components, 0);
+  out_components->bounding_rectangles.assign(num_components, Rect());
+  out_components->run_offsets.assign(num_components + 1, 0);
+  std::vector<int>& x1 = scratch.x1;
+  std::vector<int>& y1 = scratch.y1;
+  std::vector<int>& x2 = scratch.x2;
+  std::vector<int>& y2 = scratch.y2;
+  x1.assign(num_components, INT_MAX);
+  y1.assign(num_components, INT_MAX);
+  x2.assign(num_components, -1);
+  y2.assign(num_components, -1);
+  for (size_t i = 0; i < runs.size(); i++) {
+    int c = components[runs[i].label];
+    runs[i].label = c;
+    out_components->areas[c] += runs[i].x_end - runs[i].x_begin;
+    out_components->run_offsets[c + 1]++;
+    x1[c] = std::min(x1[c], runs[i].x_begin);
+    x2[c] = std::max(x2[c], runs[i].x_end);
+    y1[c] = std::min(y1[c], runs[i].y);
+    y2[c] = std::max(y2[c], runs[i].y + 1);
+  }
+  for (int c = 0; c < num_components; c++) {
+    out_components->bounding_rectangles[c] = Rect(x1[c], y1[c], x2[c] - x1[c], y2[c] - y1[c]);
+    out_components->run_offsets[c + 1] += out_components->run_offsets[c];
+  }
+  std::vector<size_t>& fill = scratch.fill;
+  fill.assign(out_components->run_offsets.begin(), out_components->run_offsets.end() - 1);
+  out_components->runs.resize(runs.size());
+  for (size_t i = 0; i < runs.size(); i++) { out_components->runs[fill[runs[i].label]++] = runs[i]; }
+
+  // Paint the label image from the runs
+  if (out_labels != nullptr) {
+    out_labels->create(mask.rows, mask.cols, CV_32S);
+    out_labels->setTo(Scalar(0));
+    for (size_t i = 0; i < runs.size(); i++) {
+      int* row = out_labels->ptr<int>(runs[i].y);
+      std::fill(row + runs[i].x_begin, row + runs[i].x_end, runs[i].label + 1);
+    }
+  }
+}
+
+// Rasterize a component into a mask covering its bounding rectangle plus a
+// border of the given size (component pixels are 255, others 0)
+static void RasterizeComponent(const ConnectedComponents& components, int i, int border, Mat* out_mask) {
+  const Rect& r = components.bounding_rectangles[i];
+  out_mask->create(r.height + 2 * border, r.width + 2 * border, CV_8U);
+  out_mask->setTo(Scalar(0));
+  for (size_t k = components.run_offsets[i]; k < components.run_offsets[i + 1]; k++) {
+    const PixelRun& run = components.runs[k];
+    uchar* row = out_mask->ptr<uchar>(run.y - r.y + border);
+    std::memset(row + run.x_begin - r.x + border, 255, run.x_end - run.x_begin);
+  }
+}
+
+// Trace the outer contour of a single component (in image coordinates) and
+// append it to a contour store
+static void ExtractComponentContour(const ConnectedComponents& components, int i, ContourStore* out_contours) {
+  thread_local Mat mask;
+  thread_local std::vector<std::vector<Point>> contours;
+  RasterizeComponent(components, i, 1, &mask);
+  const Rect& r = components.bounding_rectangles[i];
+  findContours(mask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE, Point(r.x - 1, r.y - 1));
+
+  // An 8-connected component has a single outer border
+  out_contours->Add(contours.front());
+}
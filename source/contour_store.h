@@ -0,0 +1,82 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <vector>
+
+using namespace cv;
+
+// Read-only view of a contour: a range of points in a ContourStore. Views are
+// invalidated when points are added to or cleared from the store.
+struct ContourView {
+  const Point* points;
+  int count;
+
+  int size() const { return count; }
+  const Point& operator[](int i) const { return points[i]; }
+  const Point* begin() const { return points; }
+  const Point* end() const { return points + count; }
+};
+
+// Contours of an image stored back to back in a single point buffer: the
+// points of contour i are points[offsets[i]] .. points[offsets[i + 1] - 1].
+// The store acts as a per-image arena, Clear() releases all contours at once
+// but keeps the buffers so the next image does not allocate again.
+class ContourStore {
+public:
+  ContourStore() { offsets_.push_back(0); }
+
+  // Number of contours
+  int Size() const { return (int)offsets_.size() - 1; }
+
+  // Total number of points
+  size_t NumPoints() const { return points_.size(); }
+
+  // Remove all contours
+  void Clear() {
+    points_.clear();
+    offsets_.resize(1);
+  }
+
+  // Reserve space for a number of contours and points
+  void Reserve(size_t num_contours, size_t num_points) {
+    offsets_.reserve(num_contours + 1);
+    points_.reserve(num_points);
+  }
+
+  // Append a contour, returns its index
+  int Add(const Point* points, int count) {
+    points_.insert(points_.end(), points, points + count);
+    offsets_.push_back((int)points_.size());
+    return Size() - 1;
+  }
+
+  int Add(const std::vector<Point>& contour) { return Add(contour.data(), (int)contour.size()); }
+
+  // Replace all contours by a point buffer and num_contours + 1 offsets (as
+  // returned by PointData() and OffsetData())
+  void Assign(const Point* points, size_t num_points, const int* offsets, int num_contours) {
+    points_.assign(points, points + num_points);
+    offsets_.assign(offsets, offsets + num_contours + 1);
+  }
+
+  // The point buffer and the offsets of the contours in it
+  const Point* PointData() const { return points_.data(); }
+  const int* OffsetData() const { return offsets_.data(); }
+
+  // View of a contour
+  ContourView operator[](int i) const { return { points_.data() + offsets_[i], offsets_[i + 1] - offsets_[i] }; }
+
+private:
+  std::vector<Point> points_;
+  std::vector<int> offsets_;
+};
+
+// Fill one or more contours (all with the same color), the offset is added to
+// every point. Each contour is filled on its own, so contours that overlap or
+// lie inside each other give their union.
+static void FillContours(Mat& image, const std::vector<ContourView>& contours, const Scalar& color, Point offset = Point()) {
+  for (const ContourView& contour : contours) {
+    const Point* points = contour.points;
+    int count = contour.count;
+    fillPoly(image, &points, &count, 1, color, LINE_8, 0, offset);
+  }
+}
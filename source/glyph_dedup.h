@@ -0,0 +1,118 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+#include <vector>
+#include "contour_store.h"
+#include "profiler.h"
+#include "segment_table.h"
+
+using namespace cv;
+
+// Grouping of repeated glyphs. A page of printed text holds the same glyph
+// hundreds of times, so one decision (a tag, an exported crop) can be made
+// for a whole group. Every segment gets a 64-bit perceptual hash, glyphs that
+// look the same have hashes a few bits apart. Segments are grouped greedily,
+// largest first: a segment joins the first group whose representative has a
+// similar size and a hash within the maximum distance, otherwise it starts a
+// group of its own. Representatives are looked up with a multi-index: the
+// hash is split into distance + 1 chunks, hashes within the distance agree on
+// at least one chunk, so only representatives sharing a chunk are compared.
+
+// Perceptual hash of a segment. The gray crop of the segment (white outside
+// its contour) is centered on a square, so the aspect ratio is kept, reduced
+// to 32x32 and transformed with a DCT. Each of the 8x8 lowest frequencies
+// gives a bit: whether it is above the median of the 63 AC frequencies.
+static uint64 GlyphHash(const Mat& image_1c, const ContourView& contour, const Rect& bounding_rectangle) {
+  thread_local Mat mask, square, reduced, frequencies;
+  int side = std::max(bounding_rectangle.width, bounding_rectangle.height);
+  mask.create(bounding_rectangle.height, bounding_rectangle.width, CV_8U);
+  mask.setTo(Scalar(0));
+  FillContours(mask, { contour }, Scalar(255), Point(-bounding_rectangle.x, -bounding_rectangle.y));
+  square.create(side, side, CV_8U);
+  square.setTo(Scalar(255));
+  Mat center = square(Rect((side - bounding_rectangle.width) / 2, (side - bounding_rectangle.height) / 2, bounding_rectangle.width, bounding_rectangle.height));
+  image_1c(bounding_rectangle).copyTo(center, mask);
+  resize(square, reduced, Size(32, 32), 0, 0, INTER_AREA);
+  reduced.convertTo(frequencies, CV_32F);
+  dct(frequencies, frequencies);
+
+  float values[64];
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) { values[y * 8 + x] = frequencies.at<float>(y, x); }
+  }
+  float ac[63];
+  std::copy(values + 1, values + 64, ac);
+  std::nth_element(ac, ac + 31, ac + 63);
+  float median = ac[31];
+  uint64 hash = 0;
+  for (int i = 0; i < 64; i++) {
+    if (values[i] > median) { hash |= (uint64)1 << i; }
+  }
+  return hash;
+}
+
+// Number of bits in which two hashes differ
+static int HammingDistance(uint64 a, uint64 b) {
+  uint64 x = a ^ b;
+  x = x - ((x >> 1) & 0x5555555555555555ull);
+  x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+// Whether two glyphs have a similar size (width and height within 20%, or
+// within 2 pixels for small glyphs). Hashes are scale invariant, this keeps a
+// speck from joining the group of a dot-like character.
+static bool SimilarGlyphSize(const Rect& a, const Rect& b) {
+  return std::abs(a.width - b.width) <= std::max(2, std::max(a.width, b.width) / 5)
+      && std::abs(a.height - b.height) <= std::max(2, std::max(a.height, b.height) / 5);
+}
+
+// Group the repeated glyphs among the segments. out_groups receives for every
+// segment the id of the representative of its group (the first segment of
+// the group in the table, which is its own representative). The max distance
+// must be in [0, 7]. Returns the number of groups.
+static int GroupRepeatedGlyphs(const Mat& image_1c, const SegmentTable& segments, int max_distance, std::vector<int>* out_groups) {
+  ProfileScope scope("GroupRepeatedGlyphs");
+  int n = segments.Size();
+  std::vector<uint64> hashes(n);
+  parallel_for_(Range(0, n), [&](const Range& range) {
+    for (int i = range.start; i < range.end; i++) { hashes[i] = GlyphHash(image_1c, segments.contours[i], segments.bounding_rectangles[i]); }
+  });
+
+  // Chunk c covers bits [c * chunk_bits, (c + 1) * chunk_bits), the last
+  // chunk takes the remaining bits
+  int num_chunks = max_distance + 1;
+  int chunk_bits = 64 / num_chunks;
+  auto chunk = [num_chunks, chunk_bits](uint64 hash, int c) {
+    int shift = c * chunk_bits;
+    int bits = (c == num_chunks - 1) ? 64 - shift : chunk_bits;
+    return bits == 64 ? hash : (hash >> shift) & (((uint64)1 << bits) - 1);
+  };
+  std::vector<std::unordered_map<uint64, std::vector<int>>> index(num_chunks);
+
+  out_groups->resize(n);
+  int num_groups = 0;
+  for (int i = 0; i < n; i++) {
+    int group = -1;
+    for (int c = 0; c < num_chunks && group < 0; c++) {
+      auto bucket = index[c].find(chunk(hashes[i], c));
+      if (bucket == index[c].end()) { continue; }
+      for (int r : bucket->second) {
+        if (HammingDistance(hashes[i], hashes[r]) <= max_distance && SimilarGlyphSize(segments.bounding_rectangles[i], segments.bounding_rectangles[r])) {
+          group = r;
+          break;
+        }
+      }
+    }
+    if (group < 0) {
+      group = i;
+      num_groups++;
+      for (int c = 0; c < num_chunks; c++) { index[c][chunk(hashes[i], c)].push_back(i); }
+    }
+    (*out_groups)[i] = group;
+  }
+  return num_groups;
+}
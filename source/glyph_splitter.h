@@ -0,0 +1,78 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "contour_store.h"
+
+using namespace cv;
+
+// Automatic splitting of merged segments (touching glyphs) using the vertical
+// projection profile: the number of segment pixels in each column. A segment
+// about k glyphs wide is cut into k pieces, each cut at the column with the
+// fewest pixels near its evenly spaced position.
+
+// Split a merged segment into glyph pieces (rectangles in image coordinates,
+// tightened to the rows the piece covers). Leaves the pieces empty if the
+// segment is not at least two glyphs wide.
+static void SplitMergedSegment(const ContourView& contour, const Rect& bounding_rectangle, float glyph_width, std::vector<Rect>* out_pieces) {
+  out_pieces->clear();
+  if (glyph_width <= 0) { return; }
+  int num_pieces = (int)std::lround(bounding_rectangle.width / glyph_width);
+  if (num_pieces < 2) { return; }
+
+  // Rasterize the segment and build its profile
+  int width = bounding_rectangle.width;
+  int height = bounding_rectangle.height;
+  thread_local Mat mask;
+  thread_local std::vector<int> profile;
+  mask.create(height, width, CV_8U);
+  mask.setTo(Scalar(0));
+  FillContours(mask, { contour }, Scalar(255), Point(-bounding_rectangle.x, -bounding_rectangle.y));
+  profile.assign(width, 0);
+  for (int y = 0; y < height; y++) {
+    const uchar* row = mask.ptr<uchar>(y);
+    for (int x = 0; x < width; x++) { profile[x] += row[x] != 0; }
+  }
+
+  // Place the cuts, each within a third of the glyph pitch of its position
+  float pitch = (float)width / num_pieces;
+  std::vector<int> cuts(1, 0);
+  for (int j = 1; j < num_pieces; j++) {
+    int ideal = (int)std::lround(j * pitch);
+    int x_begin = std::max((int)(ideal - pitch / 3), cuts.back() + 1);
+    int x_end = std::min((int)(ideal + pitch / 3), width - 1);
+    if (x_begin > x_end) { continue; }
+    int best = x_begin;
+    for (int x = x_begin; x <= x_end; x++) {
+      if (profile[x] < profile[best] || (profile[x] == profile[best] && std::abs(x - ideal) < std::abs(best - ideal))) { best = x; }
+    }
+    cuts.push_back(best);
+  }
+  cuts.push_back(width);
+  if (cuts.size() < 3) { return; }
+
+  // Tighten each piece to its rows, pieces without pixels are dropped
+  for (int j = 0; j + 1 < cuts.size(); j++) {
+    int y_begin = -1;
+    int y_end = -1;
+    for (int y = 0; y < height; y++) {
+      const uchar* row = mask.ptr<uchar>(y);
+      if (std::find_if(row + cuts[j], row + cuts[j + 1], [](uchar v) { return v != 0; }) == row + cuts[j + 1]) { continue; }
+      if (y_begin < 0) { y_begin = y; }
+      y_end = y + 1;
+    }
+    if (y_begin < 0) { continue; }
+    out_pieces->push_back(Rect(bounding_rectangle.x + cuts[j], bounding_rectangle.y + y_begin, cuts[j + 1] - cuts[j], y_end - y_begin));
+  }
+  if (out_pieces->size() < 2) { out_pieces->clear(); }
+}
+
+// Typical glyph width of a page: the median width of the given rectangles
+static float MedianGlyphWidth(const std::vector<Rect>& bounding_rectangles, const std::vector<int>& ids) {
+  if (ids.empty()) { return 0; }
+  std::vector<int> widths;
+  for (int id : ids) { widths.push_back(bounding_rectangles[id].width); }
+  std::nth_element(widths.begin(), widths.begin() + widths.size() / 2, widths.end());
+  return (float)widths[widths.size() / 2];
+}
@@ -0,0 +1,215 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <vector>
+#include "profiler.h"
+
+using namespace cv;
+
+// Loading of pages for processing. A page is decoded once in the format of
+// the file (any depth, gray or color) and reduced to 8 bits per channel.
+// Gray pages (including bitonal scans) stay single-channel: the gray image is
+// then also the image pages are displayed and cropped from, so no 3-channel
+// copy exists. 16-bit and float pages are scaled to 8 bits, multi-page TIFFs
+// are read one page at a time. Large JPEGs can be decoded at reduced
+// resolution (scaled in the DCT, far cheaper than a full decode) for showing
+// a first preview while the full decode is still running.
+
+// Decoded page
+struct DecodedPage {
+  Mat image;  // 8-bit, 1 (gray) or 3 (BGR) channels
+  Mat gray;   // 8-bit gray (shares its data with image for gray pages)
+};
+
+// Flags for decoding in the format of the file (EXIF orientation is applied)
+static const int kDecodeNative = IMREAD_ANYDEPTH | IMREAD_ANYCOLOR;
+
+// Check whether a file has one of the given extensions (lowercase, with dot)
+static bool HasExtension(const String& file, const std::vector<String>& extensions) {
+  String extension = std::filesystem::path(file).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+  return std::find(extensions.begin(), extensions.end(), extension) != extensions.end();
+}
+
+// Check whether a file has an extension of a supported image format
+static bool IsImageFile(const std::filesystem::path& file) {
+  return HasExtension(file.string(), { ".jpg", ".jpeg", ".png", ".tif", ".tiff", ".bmp", ".pbm", ".pgm", ".ppm", ".webp", ".jp2" });
+}
+
+// Number of pages of a TIFF file, counted by walking the chain of image file
+// directories in the file without decoding (0 if it is not a TIFF)
+static int CountTiffPages(const String& file) {
+  std::ifstream stream(file, std::ios::binary);
+  unsigned char buffer[8];
+  if (!stream.read((char*)buffer, 4)) { return 0; }
+  bool little_endian = buffer[0] == 'I' && buffer[1] == 'I';
+  if (!little_endian && !(buffer[0] == 'M' && buffer[1] == 'M')) { return 0; }
+  auto read = [little_endian](const unsigned char* bytes, int size) {
+    uint64 value = 0;
+    for (int i = 0; i < size; i++) { value |= (uint64)bytes[little_endian ? i : size - 1 - i] << (8 * i); }
+    return value;
+  };
+  // Classic TIFF (42) has 32-bit offsets, BigTIFF (43) 64-bit offsets
+  uint64 version = read(buffer + 2, 2);
+  if (version != 42 && version != 43) { return 0; }
+  int offset_size = version == 42 ? 4 : 8;
+  int count_size = version == 42 ? 2 : 8;
+  int entry_size = version == 42 ? 12 : 20;
+  if (version == 43 && !stream.read((char*)buffer, 4)) { return 0; }
+  if (!stream.read((char*)buffer, offset_size)) { return 0; }
+  uint64 offset = read(buffer, offset_size);
+  std::set<uint64> visited;
+  int num_pages = 0;
+  while (offset != 0 && visited.insert(offset).second) {
+    stream.seekg((std::streamoff)offset);
+    if (!stream.read((char*)buffer, count_size)) { break; }
+    uint64 num_entries = read(buffer, count_size);
+    num_pages++;
+    stream.seekg((std::streamoff)(offset + count_size + num_entries * entry_size));
+    if (!stream.read((char*)buffer, offset_size)) { break; }
+    offset = read(buffer, offset_size);
+  }
+  return num_pages;
+}
+
+// Number of pages in an image file (0 if it cannot be read)
+static int CountPages(const String& file) {
+  if (!HasExtension(file, { ".tif", ".tiff" })) { return std::filesystem::exists(file) ? 1 : 0; }
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 6)
+  return (int)imcount(file, kDecodeNative);
+#else
+  return CountTiffPages(file);
+#endif
+}
+
+// Reduce a decoded image to 8 bits per channel and 1 or 3 channels. 16-bit
+// values are scaled by the bit depth actually used (12-bit data stored in
+// 16 bits keeps its contrast), float values are taken to be in [0, 1].
+static void ConvertTo8Bit(const Mat& decoded, Mat* out_image) {
+  Mat image = decoded;
+  if (image.depth() == CV_16U) {
+    double max_value = 0;
+    minMaxLoc(image.reshape(1), nullptr, &max_value);
+    int bits = 8;
+    while (bits < 16 && max_value >= (1 << bits)) { bits++; }
+    image.convertTo(image, CV_8U, 255.0 / ((1 << bits) - 1));
+  } else if (image.depth() == CV_32F || image.depth() == CV_64F) {
+    image.convertTo(image, CV_8U, 255.0);
+  } else if (image.depth() != CV_8U) {
+    normalize(image.reshape(1), image, 0, 255, NORM_MINMAX, CV_8U);
+    image = image.reshape(decoded.channels());
+  }
+  if (image.channels() == 4) {
+    cvtColor(image, image, COLOR_BGRA2BGR);
+  } else if (image.channels() == 2) {
+    extractChannel(image, image, 0);
+  }
+  *out_image = image;
+}
+
+// Turn a decoded image into a page. Returns false if the image is empty.
+static bool ConvertPage(const Mat& decoded, DecodedPage* out_page) {
+  if (decoded.empty()) { return false; }
+  ConvertTo8Bit(decoded, &out_page->image);
+  if (out_page->image.channels() == 1) {
+    out_page->gray = out_page->image;
+  } else {
+    ProfileScope scope("cvtColor");
+    cvtColor(out_page->image, out_page->gray, COLOR_BGR2GRAY);
+  }
+  return true;
+}
+
+// Decode a page of an image file (page 0 for single-page formats). Returns
+// false if the page cannot be read.
+static bool DecodePage(const String& file, int page, DecodedPage* out_page) {
+  ProfileScope scope("Decode image");
+  Mat decoded;
+  if (page == 0 && !HasExtension(file, { ".tif", ".tiff" })) {
+    decoded = imread(file, kDecodeNative);
+  } else {
+    std::vector<Mat> pages;
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 6)
+    imreadmulti(file, pages, page, 1, kDecodeNative);
+    if (!pages.empty()) { decoded = pages[0]; }
+#else
+    imreadmulti(file, pages, kDecodeNative);
+    if (page < pages.size()) { decoded = pages[page]; }
+#endif
+  }
+  return ConvertPage(decoded, out_page);
+}
+
+// Decode the first num_pages pages of an image file in order and call
+// process(index, page) for each (the page is empty if it cannot be read).
+// Every page is decoded once: one at a time where OpenCV reads a range of
+// pages, otherwise all of them in a single pass.
+template<typename F>
+static void DecodeEachPage(const String& file, int num_pages, F process) {
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 6)
+  bool one_at_a_time = true;
+#else
+  bool one_at_a_time = num_pages == 1;
+#endif
+  if (one_at_a_time) {
+    for (int i = 0; i < num_pages; i++) {
+      DecodedPage page;
+      DecodePage(file, i, &page);
+      process(i, page);
+    }
+    return;
+  }
+  std::vector<Mat> decoded;
+  {
+    ProfileScope scope("Decode image");
+    imreadmulti(file, decoded, kDecodeNative);
+  }
+  for (int i = 0; i < num_pages; i++) {
+    DecodedPage page;
+    if (i < decoded.size()) {
+      ConvertPage(decoded[i], &page);
+      decoded[i].release();
+    }
+    process(i, page);
+  }
+}
+
+// Read the size of a JPEG image from its frame header, without decoding
+static bool ReadJpegSize(const String& file, Size* out_size) {
+  std::ifstream stream(file, std::ios::binary);
+  unsigned char marker[4];
+  if (!stream.read((char*)marker, 2) || marker[0] != 0xFF || marker[1] != 0xD8) { return false; }
+  while (stream.read((char*)marker, 4)) {
+    if (marker[0] != 0xFF) { return false; }
+    int length = (marker[2] << 8) | marker[3];
+    // Start of frame markers (C0 to CF, except DHT, JPG and DAC)
+    if (marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC) {
+      unsigned char frame[5];
+      if (!stream.read((char*)frame, 5)) { return false; }
+      *out_size = Size((frame[3] << 8) | frame[4], (frame[1] << 8) | frame[2]);
+      return out_size->area() > 0;
+    }
+    stream.seekg(length - 2, std::ios::cur);
+  }
+  return false;
+}
+
+// Decode a JPEG in gray at a reduced resolution (1/2, 1/4 or 1/8) so its
+// longest side is at most max_size pixels if possible. Returns false if the
+// file is not a JPEG or small enough to decode at full resolution.
+static bool DecodeReducedPreview(const String& file, int max_size, Mat* out_gray, int* out_scale) {
+  Size size;
+  if (!HasExtension(file, { ".jpg", ".jpeg" }) || !ReadJpegSize(file, &size)) { return false; }
+  int scale = 1;
+  while (scale < 8 && std::max(size.width, size.height) / scale > max_size) { scale *= 2; }
+  if (scale == 1) { return false; }
+  ProfileScope scope("Decode preview");
+  int flags = scale == 2 ? IMREAD_REDUCED_GRAYSCALE_2 : scale == 4 ? IMREAD_REDUCED_GRAYSCALE_4 : IMREAD_REDUCED_GRAYSCALE_8;
+  *out_gray = imread(file, flags);
+  *out_scale = scale;
+  return !out_gray->empty();
+}
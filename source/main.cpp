@@ -1,57 +1,131 @@
-#include "opencv2\opencv.hpp"
+#include "opencv2/opencv.hpp"
 #include <sstream>
 #include <iomanip>
-#include "sort_permutation.h"
+#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include "adaptive_threshold.h"
+#include "auto_tagger.h"
+#include "glyph_dedup.h"
+#include "glyph_splitter.h"
+#include "image_ingest.h"
+#include "preview_cache.h"
+#include "profiler.h"
+#include "segment_exporter.h"
+#include "segment_overlay.h"
+#include "segment_preview.h"
+#include "segmentation.h"
+#include "session_checkpoint.h"
+#include "spatial_grid.h"
+#include "spool_directory.h"
+#include "thread_pool.h"
+#include "threshold_preview.h"
+#include "tiled_segmentation.h"
 #include "utility.h"
 
 using namespace cv;
 
-// Tags that can be assigned to a segment
-enum class Tag {
-  NOISE, 
-  PARTIAL, 
-  MERGED, 
-  CORRECT
-};
-
-// Data being processed
+// Data being processed. Segments stay in the segment table, the stages pass
+// around the ids of the segments they select.
 struct Data {
-  Mat input_image_3c;
-  Mat input_image_1c;
+  Mat input_image;     // Page as decoded, gray (1 channel) or color (3 channels)
+  Mat input_image_1c;  // Gray page (the same data as input_image for gray pages)
+  std::future<DecodedPage> page_loading;
+  Mat page_preview;
+  int page_preview_scale;
   Mat threshold_mask_image;
-  std::vector<std::vector<Point>> contours;
-  std::vector<uint> areas;
-  std::vector<Rect> bounding_rectangles;
-  std::vector<Tag> tags;
-
-  std::vector<std::vector<Point>> contours_correct;
-  std::vector<Rect> bounding_rectangles_correct;
-  std::vector<std::vector<Point>> contours_merged;
-  std::vector<Rect> bounding_rectangles_merged;
-  std::vector<std::vector<std::vector<Point>>> contours_partial_sets;
-  std::vector<std::vector<Rect>> bounding_rectangles_partial_sets;
+  ThresholdPreview threshold_preview;
+  Mat threshold_preview_image;
+  ThresholdMode threshold_mode;
+  int threshold_window_size;
+  int threshold;
+  float threshold_k;
+  SegmentTable segments;
+  SegmentOverlay segment_overlay;
+  int detection_line_thickness;
+  int detection_zoom;
+  Point2f detection_center;
+  Point detection_drag_start;
+  SessionCheckpointWriter session;
+  bool resumed = false;
+  std::vector<int> glyph_groups;  // Representative of the group of repeated glyphs of each segment
+
+  std::vector<int> segments_correct;
+  std::vector<int> segments_merged;
+  std::vector<std::vector<Rect>> segments_merged_pieces;
+  std::vector<std::vector<int>> partial_sets;
 };
 
 // Settings used for processing
 struct Settings {
   String input_image_file;
+  int page;
+  bool batch;
+  bool daemon;
+  int poll_interval;
+  uint queue_size;
+  int threshold;
+  ThresholdMode threshold_mode;
+  int threshold_window_size;
+  float threshold_k;
+  uint num_threads;
+  int tile_height;
   uint min_segment_area;
   uint outline_thickness;
+  bool auto_tag;
+  float auto_tag_confidence;
+  float review_fraction;
+  bool dedup;
+  int dedup_distance;
+  bool dedup_export;
   float surroundings_size;
   String output_directory;
   uint crop_margin;
+  bool split_merged;
+  String output_format;
+  String archive_encoding;
+  String session_file;
+  bool new_session;
+  bool profile;
 };
 
 // Parse the command line arguments
 static bool ParseCommandLineArguments(int argc, char* argv[], Settings* out_settings) {
   const String clp_keys =
     "{help h ? usage | | show help on the command line arguments}"
-    "{@image | | image containing characters to be segmented}"
+    "{@image | | image containing characters to be segmented (in batch mode also a directory or a .txt file list)}"
+    "{page | 0 | page of a multi-page image (TIFF) to process, counted from 0}"
+    "{batch | | process all input images without user interaction}"
+    "{threshold | 192 | threshold separating characters from the background (-1 picks one automatically)}"
+    "{threshold-mode | global | one threshold for the whole image (global) or local thresholds for uneven illumination (mean, sauvola)}"
+    "{threshold-window | 51 | window size of local thresholding (pixels)}"
+    "{threshold-k | 0.2 | sensitivity of local thresholding}"
+    "{daemon | | keep running and process the pages dropped into the directory given as image, without user interaction}"
+    "{poll-interval | 500 | in daemon mode, interval between checks for new pages (ms)}"
+    "{queue-size | 0 | in daemon mode, max pages queued or in progress, further pages wait in the directory (0 is twice the threads)}"
+    "{threads | 0 | number of worker threads in batch and daemon mode (0 uses all cores)}"
+    "{tile-height | 0 | in batch and daemon mode, process images in strips of this many rows to bound memory (0 disables)}"
     "{outline-thickness | 4 | thickness of the outline used to highlight segments}"
     "{min-area | 20 | min area of a detected character (to remove noise speckles)}"
+    "{auto-tag | | tag obvious segments automatically, only uncertain segments are shown for tagging}"
+    "{auto-tag-confidence | 0.5 | min confidence (0 to 1) of an automatic tag}"
+    "{review | 0.05 | fraction of the automatic tags that is shown for review}"
+    "{dedup | | tag repeated glyphs once, the tag applies to all near-identical segments}"
+    "{dedup-distance | 3 | max number of differing bits (0 to 7) between the 64-bit hashes of repeated glyphs}"
+    "{dedup-export | | export one segment per group of repeated glyphs, the repeats are listed in <output-dir>/duplicates.csv (files output only)}"
     "{surroundings-size | 10.0 | relative size of surroundings to show on preview}"
     "{output-dir | output | directory where to store output}"
     "{crop-margin | 2 | margin to add when cropping segments}"
+    "{split-merged | | split merged segments into glyphs automatically (the merged segments are exported as well)}"
+    "{output-format | files | store segments as separate image files (files) or in a single archive (archive)}"
+    "{archive-encoding | jpg | encoding of the segments in an archive (raw, jpg or png)}"
+    "{session | | session checkpoint for resuming an interrupted run (default <output-dir>/session.ckpt)}"
+    "{new-session | | start over instead of resuming the session of the image}"
+    "{profile | | print a timing summary and write a Chrome trace to <output-dir>/trace.json}"
     ;
 
   // Show help if requested
@@ -63,172 +137,181 @@ static bool ParseCommandLineArguments(int argc, char* argv[], Settings* out_sett
 
   // Parse arguments
   out_settings->input_image_file = clp.get<String>("@image");
+  out_settings->page = clp.get<int>("page");
+  out_settings->batch = clp.has("batch");
+  out_settings->daemon = clp.has("daemon");
+  out_settings->poll_interval = clp.get<int>("poll-interval");
+  out_settings->queue_size = clp.get<uint>("queue-size");
+  out_settings->threshold = clp.get<int>("threshold");
+  String threshold_mode = clp.get<String>("threshold-mode");
+  out_settings->threshold_window_size = clp.get<int>("threshold-window");
+  out_settings->threshold_k = clp.get<float>("threshold-k");
+  out_settings->num_threads = clp.get<uint>("threads");
+  out_settings->tile_height = clp.get<int>("tile-height");
   out_settings->outline_thickness = clp.get<uint>("outline-thickness");
   out_settings->min_segment_area = clp.get<uint>("min-area");
+  out_settings->auto_tag = clp.has("auto-tag");
+  out_settings->auto_tag_confidence = clp.get<float>("auto-tag-confidence");
+  out_settings->review_fraction = clp.get<float>("review");
+  out_settings->dedup = clp.has("dedup");
+  out_settings->dedup_distance = clp.get<int>("dedup-distance");
+  out_settings->dedup_export = clp.has("dedup-export");
   out_settings->surroundings_size = clp.get<float>("surroundings-size");
   out_settings->output_directory = clp.get<String>("output-dir");
   out_settings->crop_margin = clp.get<uint>("crop-margin");
+  out_settings->split_merged = clp.has("split-merged");
+  out_settings->output_format = clp.get<String>("output-format");
+  out_settings->archive_encoding = clp.get<String>("archive-encoding");
+  out_settings->session_file = clp.get<String>("session");
+  out_settings->new_session = clp.has("new-session");
+  out_settings->profile = clp.has("profile");
 
   // Show errors if any occurred
   if (!clp.check()) {
     clp.printErrors();
     return false;
   }
+  if (!ParseThresholdMode(threshold_mode, &out_settings->threshold_mode)) {
+    std::cout << "ERROR: unknown threshold mode '" << threshold_mode << "'." << std::endl;
+    return false;
+  }
+  if (out_settings->threshold_mode != ThresholdMode::GLOBAL && out_settings->tile_height > 0) {
+    std::cout << "ERROR: local thresholding cannot be combined with tiled processing." << std::endl;
+    return false;
+  }
+  if (out_settings->output_format != "files" && out_settings->output_format != "archive") {
+    std::cout << "ERROR: unknown output format '" << out_settings->output_format << "'." << std::endl;
+    return false;
+  }
+  if (out_settings->archive_encoding != "raw" && out_settings->archive_encoding != "jpg" && out_settings->archive_encoding != "png") {
+    std::cout << "ERROR: unknown archive encoding '" << out_settings->archive_encoding << "'." << std::endl;
+    return false;
+  }
+  if (out_settings->daemon && out_settings->output_format != "files") {
+    std::cout << "ERROR: daemon mode only writes segments as files." << std::endl;
+    return false;
+  }
+  if (out_settings->dedup_export && out_settings->output_format != "files") {
+    std::cout << "ERROR: -dedup-export lists segment files, it cannot be combined with the archive output format." << std::endl;
+    return false;
+  }
+  if (out_settings->daemon && out_settings->poll_interval <= 0) {
+    std::cout << "ERROR: invalid poll interval " << out_settings->poll_interval << "." << std::endl;
+    return false;
+  }
+  if (out_settings->dedup_distance < 0 || out_settings->dedup_distance > 7) {
+    std::cout << "ERROR: invalid dedup distance " << out_settings->dedup_distance << " (0 to 7)." << std::endl;
+    return false;
+  }
+  if (out_settings->page < 0) {
+    std::cout << "ERROR: invalid page " << out_settings->page << "." << std::endl;
+    return false;
+  }
   if (out_settings->input_image_file.compare("") == 0) {
     std::cout << "ERROR: no input image specified. Use 'CharacterSegmenter -help' for info." << std::endl;
   }
+  if (out_settings->session_file.empty()) { out_settings->session_file = out_settings->output_directory + "/session.ckpt"; }
 
   return true;
 }
 
-// Perform thresholding to separate characters from background
-static void PerformThresholding(const Mat& image, int t, Mat* out_threshold_mask) {
-  threshold(image, *out_threshold_mask, t, 255, THRESH_BINARY);
-  imshow("CharacterSegmenter (Step 1. Thresholding)", *out_threshold_mask);
+// Threshold an image with the thresholding mode of the settings (t is only
+// used by global thresholding, k only by local thresholding)
+static void ThresholdImage(const Mat& image, const Settings& settings, int t, float k, Mat* out_threshold_mask) {
+  if (settings.threshold_mode == ThresholdMode::GLOBAL) {
+    PerformThresholding(image, t, out_threshold_mask);
+    return;
+  }
+  PerformAdaptiveThresholding(image, settings.threshold_mode, settings.threshold_window_size, k, out_threshold_mask);
 }
 
-// Callback for adjusting the threshold slider
+// Callback for adjusting the threshold slider (only the preview is thresholded)
 static void CallbackThreshold(int t, void* userdata) {
   Data* data = (Data*)(userdata);
-  PerformThresholding(data->input_image_1c, t, &(data->threshold_mask_image));
+  data->threshold_preview.Render(t, &data->threshold_preview_image);
+  imshow("CharacterSegmenter (Step 1. Thresholding)", data->threshold_preview_image);
 }
 
-// Perform segmentation to find individual characters
-static void PerformSegmentation(const Mat& image_thresholded, uint min_area, std::vector<std::vector<Point>>* out_contours, std::vector<uint>* out_areas, std::vector<Rect>* out_bounding_rectangles) {
-  Mat image_thresholded_inverted = 255 - image_thresholded;
-  findContours(image_thresholded_inverted, *out_contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);  
-
-  // Calculate metadata for all contours
-  for (int i = 0; i < out_contours->size(); i++) {
-    out_areas->push_back(contourArea(out_contours->at(i)));
-    out_bounding_rectangles->push_back(boundingRect(out_contours->at(i)));
-  }
-
-  // Sort contours and their metadata by area
-  auto p = sort_permutation(*out_areas, [](uint const& a, uint const& b) { return a > b; });
-  apply_permutation_in_place(*out_contours, p);
-  apply_permutation_in_place(*out_areas, p);
-  apply_permutation_in_place(*out_bounding_rectangles, p);
-
-  // Remove contours of zero area
-  while (out_areas->size() > 0 && out_areas->back() < min_area) {
-    out_contours->pop_back();
-    out_areas->pop_back();
-    out_bounding_rectangles->pop_back();
-  }
+// Callback for adjusting the sensitivity slider of local thresholding (in %)
+static void CallbackThresholdK(int k, void* userdata) {
+  Data* data = (Data*)(userdata);
+  data->threshold_preview.RenderAdaptive(data->threshold_mode, data->threshold_window_size, k / 100.0, &data->threshold_preview_image);
+  imshow("CharacterSegmenter (Step 1. Thresholding)", data->threshold_preview_image);
 }
 
-// Draw the contours of all segments found in the image
-static void DrawSegmentationContours(const Mat& image, const std::vector<std::vector<Point>>& contours, int line_thickness) {
-  Mat result;
-  image.copyTo(result);
-  for (int i = 0; i < contours.size(); i++) {
-    drawContours(result, contours, i, Scalar(rand() % 255, rand() % 255, rand() % 255), line_thickness);
-  }
-  imshow("CharacterSegmenter (Step 2. Character detection)", result);
+// Show the outlines of all segments found in the image (zoomed around the
+// view center)
+static void ShowSegmentationContours(Data* data) {
+  Mat view;
+  data->segment_overlay.Render(data->detection_line_thickness, data->detection_zoom, data->detection_center, &view);
+  imshow("CharacterSegmenter (Step 2. Character detection)", view);
 }
 
 // Callback for adjusting the line thickness of contours
 static void CallbackLinethickness(int line_thickness, void* userdata) {
   Data* data = (Data*)(userdata);
-  DrawSegmentationContours(data->input_image_3c, data->contours, line_thickness);
+  data->detection_line_thickness = line_thickness;
+  ShowSegmentationContours(data);
 }
 
-// Generate a preview of a detected contour in its surroundings
-static void GeneratePreview(const Mat& image, std::vector<Point>& contour, const Rect& bounding_rectangle, const Scalar& color, float surroundings_size, Mat* out_preview, Mat* out_preview_contour) {
-  int size = bounding_rectangle.width > bounding_rectangle.height ? bounding_rectangle.width : bounding_rectangle.height;
-  int size_surroundings = size * surroundings_size;
-  int x_center = bounding_rectangle.x + bounding_rectangle.width / 2;
-  int y_center = bounding_rectangle.y + bounding_rectangle.height / 2;
-
-  uint x1 = clip(x_center - size_surroundings, 0, image.cols);
-  uint x2 = clip(x_center + size_surroundings, 0, image.cols);
-  uint y1 = clip(y_center - size_surroundings, 0, image.rows);
-  uint y2 = clip(y_center + size_surroundings, 0, image.rows);
-  
-  Mat preview(y2 - y1, x2 - x1, CV_8UC3);
-  image(Rect(x1, y1, x2 - x1, y2 - y1)).copyTo(preview);
-  *out_preview = preview.clone();
-
-  std::vector<std::vector<Point>> contours;
-  contours.push_back(contour);
-  drawContours(preview, contours, 0, color, -1, LINE_8, noArray(), 1, Point(-x1, -y1));
-  *out_preview_contour = preview.clone();
+// Callback for adjusting the zoom level of the detection view
+static void CallbackZoom(int zoom, void* userdata) {
+  Data* data = (Data*)(userdata);
+  data->detection_zoom = std::max(zoom, 1);
+  ShowSegmentationContours(data);
 }
 
-// Generate a preview of multiple contours in their surroundings
-static void GenerateMultiPreview(const Mat& image, std::vector<std::vector<Point>>& contours, const std::vector<Rect>& bounding_rectangles, const std::vector<Scalar>& colors, float surroundings_size, Mat* out_preview, Mat* out_preview_contour) {
-  Rect combined_bounding_rectangle = GetBoundingRect(bounding_rectangles);
-  int size = combined_bounding_rectangle.width > combined_bounding_rectangle.height ? combined_bounding_rectangle.width : combined_bounding_rectangle.height;
-  int size_surroundings = size * surroundings_size;
-  int x_center = combined_bounding_rectangle.x + combined_bounding_rectangle.width / 2;
-  int y_center = combined_bounding_rectangle.y + combined_bounding_rectangle.height / 2;
-
-  uint x1 = clip(x_center - size_surroundings, 0, image.cols);
-  uint x2 = clip(x_center + size_surroundings, 0, image.cols);
-  uint y1 = clip(y_center - size_surroundings, 0, image.rows);
-  uint y2 = clip(y_center + size_surroundings, 0, image.rows);
-
-  Mat preview(y2 - y1, x2 - x1, CV_8UC3);
-  image(Rect(x1, y1, x2 - x1, y2 - y1)).copyTo(preview);
-  *out_preview = preview.clone();
-
-  for (int i = 0; i < contours.size(); i++) {
-    drawContours(preview, contours, i, colors[i], -1, LINE_8, noArray(), 1, Point(-x1, -y1));
-  }
-  *out_preview_contour = preview.clone();
+// Callback for panning the zoomed detection view by dragging with the mouse
+static void CallbackDetectionMouse(int event, int x, int y, int flags, void* userdata) {
+  Data* data = (Data*)(userdata);
+  if (event == EVENT_LBUTTONDOWN) { data->detection_drag_start = Point(x, y); }
+  if (event != EVENT_MOUSEMOVE || !(flags & EVENT_FLAG_LBUTTON) || data->detection_zoom <= 1) { return; }
+  Rect region = data->segment_overlay.ViewRegion(data->detection_zoom, data->detection_center);
+  float pixels_per_view_pixel = (float)region.width / data->segment_overlay.ViewSize().width;
+  Point delta = Point(x, y) - data->detection_drag_start;
+  data->detection_drag_start = Point(x, y);
+  // Start from the center of the region shown, which is kept inside the image
+  data->detection_center = Point2f(region.x + region.width / 2.0f - delta.x * pixels_per_view_pixel, region.y + region.height / 2.0f - delta.y * pixels_per_view_pixel);
+  ShowSegmentationContours(data);
 }
 
-// Move segments of a specific tag to a different vector
-static void MoveSegmentsByTag(std::vector<std::vector<Point>>* in_contours, std::vector<Tag>* in_tags, std::vector<Rect>* in_bounding_rectangles, Tag tag, std::vector<std::vector<Point>>* out_contours, std::vector<Rect>* out_bounding_rectangles) {
-  int i = 0;
-  while (true) {
-    if (in_tags->at(i) == tag) {
-      out_contours->push_back(in_contours->at(i));
-      out_bounding_rectangles->push_back(in_bounding_rectangles->at(i));
-      in_contours->erase(in_contours->begin() + i);
-      in_tags->erase(in_tags->begin() + i);
-      in_bounding_rectangles->erase(in_bounding_rectangles->begin() + i);
-    } else {
-      i += 1;
-    }
-    if (i >= in_tags->size()) { break; }
+// Start loading the page to process. A large JPEG is first decoded at reduced
+// resolution for the thresholding preview, the full page is then decoded in
+// the background. Returns false if the image cannot be read.
+static bool StartLoadingPage(Data* data, Settings* settings) {
+  if (settings->page == 0 && DecodeReducedPreview(settings->input_image_file, 2048, &data->page_preview, &data->page_preview_scale)) {
+    String file = settings->input_image_file;
+    data->page_loading = std::async(std::launch::async, [file]() {
+      DecodedPage page;
+      DecodePage(file, 0, &page);
+      return page;
+    });
+    return true;
   }
+  DecodedPage page;
+  if (!DecodePage(settings->input_image_file, settings->page, &page)) {
+    std::cout << "ERROR: could not read page " << settings->page << " of image '" << settings->input_image_file << "'." << std::endl;
+    return false;
+  }
+  data->input_image = page.image;
+  data->input_image_1c = page.gray;
+  return true;
 }
 
-// Saves a segment to an image file
-static void SaveSegment(const Mat& image, const std::vector<Point>& contour, const Rect& bounding_rectangle, const String& path, const String& name, int margin) {
-  uint x1 = clip(bounding_rectangle.x - margin, 0, image.cols);
-  uint x2 = clip(bounding_rectangle.x + bounding_rectangle.width + margin, 0, image.cols);
-  uint y1 = clip(bounding_rectangle.y - margin, 0, image.rows);
-  uint y2 = clip(bounding_rectangle.y + bounding_rectangle.height + margin, 0, image.rows);
-
-  Mat output(y2 - y1, x2 - x1, CV_8UC3, Scalar(255, 255, 255));
-  Mat mask = Mat::zeros(y2 - y1, x2 - x1, CV_8U);
-  std::vector<std::vector<Point>> contours;
-  contours.push_back(contour);
-  drawContours(mask, contours, 0, Scalar(255), -1, LINE_8, noArray(), 1, Point(-x1 , -y1));
-  image(Rect(x1, y1, x2 - x1, y2 - y1)).copyTo(output, mask);
-  imwrite(path + "/" + name + ".jpg", output);
-}
-
-// Saves multiple merged segments to an image file
-static void SaveMultiSegment(const Mat& image, const std::vector<std::vector<Point>>& contours, const std::vector<Rect>& bounding_rectangles, const String& path, const String& name, int margin) {
-  Rect combined_bounding_rectangle = GetBoundingRect(bounding_rectangles);
-  uint x1 = clip(combined_bounding_rectangle.x - margin, 0, image.cols);
-  uint x2 = clip(combined_bounding_rectangle.x + combined_bounding_rectangle.width + margin, 0, image.cols);
-  uint y1 = clip(combined_bounding_rectangle.y - margin, 0, image.rows);
-  uint y2 = clip(combined_bounding_rectangle.y + combined_bounding_rectangle.height + margin, 0, image.rows);
-
-  Mat output(y2 - y1, x2 - x1, CV_8UC3, Scalar(255, 255, 255));
-  Mat mask = Mat::zeros(y2 - y1, x2 - x1, CV_8U);
-  for (int i = 0; i < contours.size(); i++) { drawContours(mask, contours, i, Scalar(255), -1, LINE_8, noArray(), 1, Point(-x1, -y1)); }
-  image(Rect(x1, y1, x2 - x1, y2 - y1)).copyTo(output, mask);
-  imwrite(path + "/" + name + ".jpg", output);
+// Wait until the full page is loaded. Returns false if it cannot be read.
+static bool FinishLoadingPage(Data* data, Settings* settings) {
+  if (data->page_loading.valid()) {
+    DecodedPage page = data->page_loading.get();
+    data->input_image = page.image;
+    data->input_image_1c = page.gray;
+    data->page_preview.release();
+    if (data->input_image.empty()) { std::cout << "ERROR: could not read image '" << settings->input_image_file << "'." << std::endl; }
+  }
+  return !data->input_image.empty();
 }
 
-// Run the thresholding stage
-static void RunThresholdingStage(Data* data, Settings* settings) {
+// Run the thresholding stage. Returns false if the page cannot be read.
+static bool RunThresholdingStage(Data* data, Settings* settings) {
   std::cout << "Step 1. Thresholding" << std::endl;
   std::cout << "================" << std::endl;
   std::cout << ">> Use the slider to define the threshold for separating the characters from" << std::endl
@@ -237,12 +320,54 @@ static void RunThresholdingStage(Data* data, Settings* settings) {
             << "   as possible, without removing parts of characters." << std::endl;
 
   namedWindow("CharacterSegmenter (Step 1. Thresholding)", WINDOW_NORMAL);
-  int t = 192;
-  createTrackbar("Threshold", "CharacterSegmenter (Step 1. Thresholding)", &t, 255, CallbackThreshold, data);
-  CallbackThreshold(t, data);
+  if (!data->page_preview.empty()) {
+    data->threshold_preview.BuildReduced(data->page_preview, data->page_preview_scale);
+  } else {
+    if (!FinishLoadingPage(data, settings)) { return false; }
+    data->threshold_preview.Build(data->input_image_1c);
+  }
+  data->threshold_mode = settings->threshold_mode;
+  data->threshold_window_size = settings->threshold_window_size;
+  int t = settings->threshold >= 0 ? settings->threshold : data->threshold_preview.OtsuThreshold();
+  int k = (int)(settings->threshold_k * 100 + 0.5f);
+  if (settings->threshold_mode == ThresholdMode::GLOBAL) {
+    createTrackbar("Threshold", "CharacterSegmenter (Step 1. Thresholding)", &t, 255, CallbackThreshold, data);
+    CallbackThreshold(t, data);
+  } else {
+    std::cout << ">> Local thresholding: the slider sets the sensitivity (in %)." << std::endl;
+    createTrackbar("Sensitivity", "CharacterSegmenter (Step 1. Thresholding)", &k, 100, CallbackThresholdK, data);
+    CallbackThresholdK(k, data);
+  }
   std::cout << ">> Press [SPACE] to confirm your threshold" << std::endl;
-  while (waitKey(0) != ' ');
+  while (true) {
+    // Poll while the full page is decoded, its statistics replace the estimate
+    int key = waitKey(data->page_loading.valid() ? 100 : 0);
+    if (data->page_loading.valid() && data->page_loading.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      if (!FinishLoadingPage(data, settings)) { return false; }
+      data->threshold_preview.SetFullResolution(data->input_image_1c);
+      if (settings->threshold_mode == ThresholdMode::GLOBAL) {
+        CallbackThreshold(t, data);
+      } else {
+        CallbackThresholdK(k, data);
+      }
+    }
+    if (key == ' ') { break; }
+  }
   destroyWindow("CharacterSegmenter (Step 1. Thresholding)");
+  if (!FinishLoadingPage(data, settings)) { return false; }
+  if (!data->threshold_preview.HasStatistics()) { data->threshold_preview.SetFullResolution(data->input_image_1c); }
+
+  // Threshold the full-resolution image once with the confirmed threshold
+  ThresholdImage(data->input_image_1c, *settings, t, k / 100.0f, &data->threshold_mask_image);
+  data->threshold = t;
+  data->threshold_k = k / 100.0f;
+  data->threshold_preview_image.release();
+  if (settings->threshold_mode == ThresholdMode::GLOBAL) {
+    std::cout << ">> Threshold " << t << " (" << std::fixed << std::setprecision(2) << 100.0 * data->threshold_preview.ForegroundFraction(t) << "% foreground)" << std::endl;
+  } else {
+    std::cout << ">> Sensitivity " << k << "%" << std::endl;
+  }
+  return true;
 }
 
 // Run segment detection stage
@@ -252,17 +377,93 @@ static void RunSegmentDetectionStage(Data* data, Settings* settings) {
   std::cout << ">> Detecting all individual characters after thresholding. This can" << std::endl
             << "   take a few seconds. Use the line thickness trackbar to adjust the" << std::endl
             << "   size of the detection lines (for visual clarity)." << std::endl;
-  PerformSegmentation(data->threshold_mask_image, settings->min_segment_area, &data->contours, &data->areas, &data->bounding_rectangles);
+  PerformSegmentation(data->threshold_mask_image, settings->min_segment_area, &data->segments);
+
+  std::cout << ">> Use the zoom trackbar to zoom in, drag with the mouse to move around." << std::endl;
 
   namedWindow("CharacterSegmenter (Step 2. Character detection)", WINDOW_NORMAL);
-  int line_thickness = 4;
-  createTrackbar("Line thickness", "CharacterSegmenter (Step 2. Character detection)", &line_thickness, 16, CallbackLinethickness, data);
-  CallbackLinethickness(settings->outline_thickness, data);
+  data->segment_overlay.Build(data->input_image, data->segments);
+  data->detection_line_thickness = settings->outline_thickness;
+  data->detection_zoom = 1;
+  data->detection_center = Point2f(data->input_image.cols / 2.0f, data->input_image.rows / 2.0f);
+  int line_thickness = settings->outline_thickness;
+  int zoom = 1;
+  createTrackbar("Line thickness", "CharacterSegmenter (Step 2. Character detection)", &line_thickness, SegmentOverlay::kMaxThickness, CallbackLinethickness, data);
+  createTrackbar("Zoom", "CharacterSegmenter (Step 2. Character detection)", &zoom, 16, CallbackZoom, data);
+  setMouseCallback("CharacterSegmenter (Step 2. Character detection)", CallbackDetectionMouse, data);
+  ShowSegmentationContours(data);
   std::cout << ">> Press [SPACE] to confirm" << std::endl;
   while (waitKey(0) != ' ');
   destroyWindow("CharacterSegmenter (Step 2. Character detection)");
 }
 
+// Source of a session: the image file, and the page of a multi-page image
+static String SessionSource(const Settings& settings) {
+  String source = std::filesystem::absolute(settings.input_image_file).string();
+  if (settings.page > 0) { source += "#" + std::to_string(settings.page); }
+  return source;
+}
+
+// Start the session checkpoint of the run, holding the segment table
+static void StartSession(Data* data, Settings* settings) {
+  std::filesystem::path path(settings->session_file);
+  if (path.has_parent_path()) { std::filesystem::create_directories(path.parent_path()); }
+  if (!data->session.Create(settings->session_file, SessionSource(*settings), data->input_image.size(), data->threshold_mode, data->threshold, data->threshold_k, data->segments)) {
+    std::cout << "ERROR: could not create session checkpoint '" << settings->session_file << "', the session cannot be resumed." << std::endl;
+    data->session.Close();
+  }
+}
+
+// Resume the session of the image from its checkpoint, instead of the
+// thresholding and detection stages. Returns false if there is no session.
+static bool ResumeSession(Data* data, Settings* settings) {
+  if (settings->new_session) { return false; }
+  int64 start = getTickCount();
+  SessionCheckpoint checkpoint;
+  if (!LoadSessionCheckpoint(settings->session_file, &checkpoint)) { return false; }
+
+  // Reject the checkpoint before waiting for the full decode of the page
+  if (checkpoint.source != SessionSource(*settings)) {
+    std::cout << ">> Session checkpoint '" << settings->session_file << "' belongs to another image, starting a new session." << std::endl;
+    return false;
+  }
+  if (checkpoint.complete) {
+    std::cout << ">> The session of this image was completed, starting a new session." << std::endl;
+    return false;
+  }
+  if (!FinishLoadingPage(data, settings)) { return false; }
+  if (checkpoint.image_size != data->input_image.size()) {
+    std::cout << ">> Session checkpoint '" << settings->session_file << "' belongs to another image, starting a new session." << std::endl;
+    return false;
+  }
+  data->threshold_mode = checkpoint.threshold_mode;
+  data->threshold = checkpoint.threshold;
+  data->threshold_k = checkpoint.threshold_k;
+  data->segments = std::move(checkpoint.segments);
+  data->partial_sets.swap(checkpoint.partial_sets);
+  data->resumed = true;
+  if (!data->session.Resume(settings->session_file, checkpoint)) {
+    std::cout << "ERROR: could not append to session checkpoint '" << settings->session_file << "', progress will not be saved." << std::endl;
+  }
+
+  int num_tagged = 0;
+  for (Tag tag : data->segments.tags) { num_tagged += tag != Tag::UNTAGGED; }
+  std::cout << "Resuming session" << std::endl;
+  std::cout << "================" << std::endl;
+  std::cout << ">> " << num_tagged << " of " << data->segments.Size() << " segments tagged, " << data->partial_sets.size() << " partial sets merged "
+            << "(loaded in " << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms). Use -new-session to start over." << std::endl;
+  return true;
+}
+
+// Group the repeated glyphs of the page (once, for tagging and exporting)
+static void GroupGlyphs(Data* data, Settings* settings) {
+  if (!data->glyph_groups.empty()) { return; }
+  int64 start = getTickCount();
+  int num_groups = GroupRepeatedGlyphs(data->input_image_1c, data->segments, settings->dedup_distance, &data->glyph_groups);
+  std::cout << ">> " << data->segments.Size() << " segments are " << num_groups << " distinct glyphs "
+            << "(grouped in " << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms)." << std::endl;
+}
+
 // Run segment tagging stage
 static void RunSegmentTaggingStage(Data* data, Settings* settings) {
   std::cout << "Step 3. Segment tagging" << std::endl;
@@ -278,50 +479,164 @@ static void RunSegmentTaggingStage(Data* data, Settings* settings) {
 
   namedWindow("CharacterSegmenter (Step 3. Segment tagging)", WINDOW_NORMAL);
   bool show_contour = true;
-  Mat preview;
-  Mat preview_contour;
-  for (int i = 0; i < data->contours.size(); i++) {
-    std::cout << ">> Tagging segment [" << i << "/" << data->contours.size() << "]: ";
-    GeneratePreview(data->input_image_3c, data->contours[i], data->bounding_rectangles[i], Scalar(255, 0, 0), settings->surroundings_size, &preview, &preview_contour);
-    imshow("CharacterSegmenter (Step 3. Segment tagging)", preview);
+  const Mat* preview;
+  const Mat* preview_contour;
+  SegmentTable& segments = data->segments;
+
+  // Segments to tag by hand. With automatic tagging, these are the segments
+  // without a confident automatic tag, plus an evenly spread sample of the
+  // automatic tags for review. Only tags given (or confirmed) by hand are
+  // logged to the session, automatic tags are computed again on resuming, so
+  // the tags of a resumed session mark the segments done by hand.
+  std::vector<int> queue;
+  std::vector<Tag> auto_tags(segments.Size(), Tag::UNTAGGED);
+  std::vector<bool> tagged_by_hand(segments.Size());
+  for (int i = 0; i < segments.Size(); i++) { tagged_by_hand[i] = segments.tags[i] != Tag::UNTAGGED; }
+  if (settings->auto_tag) {
+    std::vector<float> confidences;
+    AutoTagSegments(segments, &auto_tags, &confidences);
+    int num_auto_tagged = 0;
+    float review_credit = 0;
+    for (int i = 0; i < segments.Size(); i++) {
+      if (auto_tags[i] == Tag::UNTAGGED || confidences[i] < settings->auto_tag_confidence) {
+        auto_tags[i] = Tag::UNTAGGED;
+        queue.push_back(i);
+        continue;
+      }
+      if (!tagged_by_hand[i]) { segments.tags[i] = auto_tags[i]; }
+      num_auto_tagged++;
+      review_credit += settings->review_fraction;
+      if (review_credit >= 1.0f) {
+        review_credit -= 1.0f;
+        queue.push_back(i);
+      }
+    }
+    std::cout << ">> Tagged " << num_auto_tagged << " of " << segments.Size() << " segments automatically, "
+              << queue.size() << " segments to tag or review." << std::endl;
+  } else {
+    for (int i = 0; i < segments.Size(); i++) { queue.push_back(i); }
+  }
+
+  // With grouping of repeated glyphs, only the first segment of a group is
+  // asked for, its tag also applies to the repeats further down the queue
+  std::vector<std::vector<int>> repeats(queue.size());
+  if (settings->dedup) {
+    GroupGlyphs(data, settings);
+    std::vector<int> first(segments.Size(), -1);
+    std::vector<int> kept;
+    repeats.clear();
+    for (int i : queue) {
+      int group = data->glyph_groups[i];
+      if (first[group] >= 0) {
+        repeats[first[group]].push_back(i);
+        continue;
+      }
+      first[group] = (int)kept.size();
+      kept.push_back(i);
+      repeats.emplace_back();
+    }
+    std::cout << ">> " << queue.size() - kept.size() << " repeated glyphs are tagged along with the first of their group, "
+              << kept.size() << " segments to tag or review." << std::endl;
+    queue.swap(kept);
+  }
+  // Segments that a tag of the queue applies to
+  auto tagged_segments = [&queue, &repeats](int q) {
+    std::vector<int> ids = { queue[q] };
+    ids.insert(ids.end(), repeats[q].begin(), repeats[q].end());
+    return ids;
+  };
+
+  // Previews are rendered ahead while the operator is tagging
+  PreviewCache previews;
+  previews.Reset((int)queue.size(), [data, settings, queue](int i, Mat* out_preview, Mat* out_preview_contour) {
+    const SegmentTable& segments = data->segments;
+    GeneratePreview(data->input_image, segments.contours[queue[i]], segments.bounding_rectangles[queue[i]], Scalar(255, 0, 0), settings->surroundings_size, out_preview, out_preview_contour);
+  });
+  // A resumed session continues at the first entry with a segment not tagged
+  // by hand (review entries carry automatic tags until they are confirmed)
+  auto fully_tagged = [&](int q) {
+    for (int id : tagged_segments(q)) {
+      if (!tagged_by_hand[id]) { return false; }
+    }
+    return true;
+  };
+  int q_begin = 0;
+  if (data->resumed) {
+    while (q_begin < queue.size() && fully_tagged(q_begin)) { q_begin++; }
+  }
+  for (int q = q_begin; q < queue.size(); q++) {
+    int i = queue[q];
+    std::cout << ">> Tagging segment [" << q << "/" << queue.size() << "]";
+    if (auto_tags[i] != Tag::UNTAGGED) { std::cout << " (review, auto-tagged " << TagName(auto_tags[i]) << ")"; }
+    if (!repeats[q].empty()) { std::cout << " (+" << repeats[q].size() << " repeats)"; }
+    std::cout << ": ";
+    previews.Get(q, &preview, &preview_contour);
+    imshow("CharacterSegmenter (Step 3. Segment tagging)", *preview);
     int last_key = -1;
     while (last_key != 'n' && last_key != 'p' && last_key != 'm' && last_key != 'c' && last_key != 'z') {
       show_contour = !show_contour;
-      imshow("CharacterSegmenter (Step 3. Segment tagging)", show_contour ? preview_contour : preview);
+      imshow("CharacterSegmenter (Step 3. Segment tagging)", show_contour ? *preview_contour : *preview);
       last_key = waitKeyEx(250);
     }
 
     // Process the pressed key
     if (last_key == 'n') {
       std::cout << "NOISE" << std::endl;
-      data->tags.push_back(Tag::NOISE);
+      for (int id : tagged_segments(q)) {
+        segments.tags[id] = Tag::NOISE;
+        data->session.AppendTag(id, Tag::NOISE);
+      }
       continue;
     }
     if (last_key == 'p') {
       std::cout << "PARTIAL" << std::endl;
-      data->tags.push_back(Tag::PARTIAL);
+      for (int id : tagged_segments(q)) {
+        segments.tags[id] = Tag::PARTIAL;
+        data->session.AppendTag(id, Tag::PARTIAL);
+      }
       continue;
     }
     if (last_key == 'm') {
       std::cout << "MERGED" << std::endl;
-      data->tags.push_back(Tag::MERGED);
+      for (int id : tagged_segments(q)) {
+        segments.tags[id] = Tag::MERGED;
+        data->session.AppendTag(id, Tag::MERGED);
+      }
       continue;
     }
     if (last_key == 'c') {
       std::cout << "CORRECT" << std::endl;
-      data->tags.push_back(Tag::CORRECT);
+      for (int id : tagged_segments(q)) {
+        segments.tags[id] = Tag::CORRECT;
+        data->session.AppendTag(id, Tag::CORRECT);
+      }
       continue;
     }
-    if (last_key == 'z' && i > 0) {
+    if (last_key == 'z' && q > 0) {
       std::cout << "... undoing previous tag" << std::endl;
-      i -= 2;
-      data->tags.pop_back();
+      for (int id : tagged_segments(q - 1)) {
+        segments.tags[id] = auto_tags[id];
+        data->session.AppendTag(id, Tag::UNTAGGED); // Not tagged by hand anymore
+      }
+      q -= 2;
       continue;
     }
   }
   destroyWindow("CharacterSegmenter (Step 3. Segment tagging)");
-  MoveSegmentsByTag(&data->contours, &data->tags, &data->bounding_rectangles, Tag::CORRECT, &data->contours_correct, &data->bounding_rectangles_correct);
-  MoveSegmentsByTag(&data->contours, &data->tags, &data->bounding_rectangles, Tag::MERGED, &data->contours_merged, &data->bounding_rectangles_merged);
+
+  // Report how often the reviewed automatic tags were changed
+  int num_reviewed = 0;
+  int num_changed = 0;
+  for (int i : queue) {
+    if (auto_tags[i] == Tag::UNTAGGED) { continue; }
+    num_reviewed++;
+    num_changed += segments.tags[i] != auto_tags[i];
+  }
+  if (num_reviewed > 0) { std::cout << ">> Review: " << num_changed << " of " << num_reviewed << " automatic tags changed." << std::endl; }
+  std::vector<std::vector<int>> partitions;
+  segments.PartitionByTag(&partitions);
+  data->segments_correct.swap(partitions[(int)Tag::CORRECT]);
+  data->segments_merged.swap(partitions[(int)Tag::MERGED]);
 }
 
 // Run partial segment merging stage
@@ -341,58 +656,101 @@ static void RunPartialSegmentMergingStage(Data* data, Settings* settings) {
 
   namedWindow("CharacterSegmenter (Step 4. Partial segment merging)", WINDOW_NORMAL);
   bool show_contour = true;
-  Mat preview;
-  Mat preview_contours;
+  const Mat* preview;
+  const Mat* preview_contours;
 
-  while (data->contours.size() > 0) { // Start new partial set
-    std::cout << ">> Starting new partial set." << std::endl;
-    std::vector<std::vector<Point>> current_partial_set_contours;
-    std::vector<Rect> current_partial_set_bounding_rectangles;
-    current_partial_set_contours.push_back(data->contours.front());
-    current_partial_set_bounding_rectangles.push_back(data->bounding_rectangles.front());
-    data->contours.erase(data->contours.begin());
-    data->bounding_rectangles.erase(data->bounding_rectangles.begin());
+  // Partial segments still available for merging. New sets start from the
+  // largest one left, proposals come from a grid over their rectangles in
+  // order of distance to the rectangle of the set.
+  std::vector<std::vector<int>> partitions;
+  data->segments.PartitionByTag(&partitions);
+  const std::vector<int>& candidates = partitions[(int)Tag::PARTIAL];
+  // Cells of twice the mean size of a partial segment (at least 16 pixels)
+  int64 size_sum = 0;
+  for (int id : candidates) { size_sum += std::max(data->segments.bounding_rectangles[id].width, data->segments.bounding_rectangles[id].height); }
+  int cell_size = candidates.empty() ? 16 : std::max(16, (int)(2 * size_sum / (int64)candidates.size()));
+  SpatialGrid grid(data->input_image.size(), cell_size);
+  for (int id : candidates) { grid.Insert(id, data->segments.bounding_rectangles[id]); }
+  std::vector<char> merged(data->segments.Size(), 0);
+  std::vector<char> rejected(data->segments.Size(), 0);
+  std::vector<int> rejected_ids;
+
+  // Partial sets completed before a session was resumed
+  for (const std::vector<int>& partial_set : data->partial_sets) {
+    for (int id : partial_set) {
+      merged[id] = 1;
+      grid.Remove(id);
+    }
+  }
 
-    std::vector<std::vector<Point>> preview_data_contours(current_partial_set_contours);
-    std::vector<Rect> preview_data_bounding_rectangles(current_partial_set_bounding_rectangles);
+  // Proposals are looked up in batches. The previews of a batch are rendered
+  // ahead, accepting a proposal changes the rectangle of the set and starts a
+  // new batch.
+  const int kProposalBatchSize = 16;
+  PreviewCache previews;
+  std::vector<int> proposals;
+  int i_proposal = 0;
+  auto find_proposals = [&](const std::vector<int>& partial_set, const Rect& partial_set_rectangle) {
+    grid.Nearest(partial_set_rectangle, kProposalBatchSize, [&](int id) { return rejected[id] != 0; }, &proposals);
+    if (proposals.empty() && grid.Size() > 0) { // All rejected: start over
+      for (int id : rejected_ids) { rejected[id] = 0; }
+      rejected_ids.clear();
+      grid.Nearest(partial_set_rectangle, kProposalBatchSize, [&](int id) { return false; }, &proposals);
+    }
+    i_proposal = 0;
+    previews.Reset((int)proposals.size(), [data, settings, partial_set, proposals](int i, Mat* out_preview, Mat* out_preview_contour) {
+      std::vector<int> preview_data_segments(partial_set);
+      preview_data_segments.push_back(proposals[i]);
+      std::vector<Scalar> preview_data_colours(partial_set.size(), Scalar(255, 0, 0));
+      preview_data_colours.push_back(Scalar(0, 255, 0));
+      GenerateMultiPreview(data->input_image, data->segments, preview_data_segments, preview_data_colours, settings->surroundings_size, out_preview, out_preview_contour);
+    });
+  };
+
+  for (int first : candidates) { // Start new partial set
+    if (merged[first]) { continue; }
+    std::cout << ">> Starting new partial set." << std::endl;
+    std::vector<int> current_partial_set;
+    current_partial_set.push_back(first);
+    Rect current_partial_set_rectangle = data->segments.bounding_rectangles[first];
+    merged[first] = 1;
+    grid.Remove(first);
+    for (int id : rejected_ids) { rejected[id] = 0; }
+    rejected_ids.clear();
 
-    int i_proposed = 0;
+    find_proposals(current_partial_set, current_partial_set_rectangle);
     while (true) { // Cycle through proposed merge candidates
-      if (data->contours.size() == 0) {
+      if (grid.Size() == 0) {
         std::cout << "   PARTIAL SET COMPLETED (no partial segments left)" << std::endl;
         break;
       }
 
-      std::cout << "   Proposing partial segment [" << i_proposed << "/" << data->contours.size() << "]: ";
-      preview_data_contours.push_back(data->contours.at(i_proposed));
-      preview_data_bounding_rectangles.push_back(data->bounding_rectangles.at(i_proposed));
-      std::vector<Scalar> preview_data_colours;
-      for (int i = 0; i < current_partial_set_contours.size(); i++) { preview_data_colours.push_back(Scalar(255, 0, 0)); }
-      preview_data_colours.push_back(Scalar(0, 255, 0));
-      GenerateMultiPreview(data->input_image_3c, preview_data_contours, preview_data_bounding_rectangles, preview_data_colours, settings->surroundings_size, &preview, &preview_contours);
-      imshow("CharacterSegmenter (Step 4. Partial segment merging)", preview);
+      int proposed = proposals[i_proposal];
+      std::cout << "   Proposing partial segment [" << proposed << "] (" << grid.Size() << " left): ";
+      previews.Get(i_proposal, &preview, &preview_contours);
+      imshow("CharacterSegmenter (Step 4. Partial segment merging)", *preview);
       int last_key = -1;
       while (last_key != 'a' && last_key != 'r' && last_key != 'c') {
         show_contour = !show_contour;
-        imshow("CharacterSegmenter (Step 4. Partial segment merging)", show_contour ? preview_contours : preview);
+        imshow("CharacterSegmenter (Step 4. Partial segment merging)", show_contour ? *preview_contours : *preview);
         last_key = waitKeyEx(250);
-      }     
+      }
 
       // Process the pressed key
       if (last_key == 'a') {
         std::cout << "   ACCEPTED" << std::endl;
-        current_partial_set_contours.push_back(data->contours.at(i_proposed));
-        current_partial_set_bounding_rectangles.push_back(data->bounding_rectangles.at(i_proposed));
-        data->contours.erase(data->contours.begin() + i_proposed);
-        data->bounding_rectangles.erase(data->bounding_rectangles.begin() + i_proposed);
-        i_proposed = (i_proposed >= data->contours.size()) ? 0 : i_proposed;
+        current_partial_set.push_back(proposed);
+        current_partial_set_rectangle |= data->segments.bounding_rectangles[proposed];
+        merged[proposed] = 1;
+        grid.Remove(proposed);
+        find_proposals(current_partial_set, current_partial_set_rectangle);
         continue;
       }
       if (last_key == 'r') {
         std::cout << "   REJECTED" << std::endl;
-        preview_data_contours.pop_back();
-        preview_data_bounding_rectangles.pop_back();
-        i_proposed = (i_proposed + 1 >= data->contours.size()) ? 0 : i_proposed + 1;
+        rejected[proposed] = 1;
+        rejected_ids.push_back(proposed);
+        if (++i_proposal == proposals.size()) { find_proposals(current_partial_set, current_partial_set_rectangle); }
         continue;
       }
       if (last_key == 'c') {
@@ -400,48 +758,491 @@ static void RunPartialSegmentMergingStage(Data* data, Settings* settings) {
         break;
       }
     }
-    data->contours_partial_sets.push_back(current_partial_set_contours);
-    data->bounding_rectangles_partial_sets.push_back(current_partial_set_bounding_rectangles);
+    data->partial_sets.push_back(current_partial_set);
+    data->session.AppendPartialSet(current_partial_set);
   }
 }
 
+// Run merged segment splitting stage
+static void RunMergedSegmentSplittingStage(Data* data, Settings* settings) {
+  data->segments_merged_pieces.assign(data->segments_merged.size(), std::vector<Rect>());
+  if (!settings->split_merged || data->segments_merged.empty()) { return; }
+  std::cout << "Step 5. Merged segment splitting" << std::endl;
+  std::cout << "================" << std::endl;
+
+  // The glyph width is taken from the correct segments if there are any
+  const SegmentTable& segments = data->segments;
+  std::vector<int> all_ids(segments.Size());
+  for (int i = 0; i < segments.Size(); i++) { all_ids[i] = i; }
+  float glyph_width = MedianGlyphWidth(segments.bounding_rectangles, data->segments_correct.empty() ? all_ids : data->segments_correct);
+
+  ThreadPool pool(settings->num_threads);
+  for (int i = 0; i < data->segments_merged.size(); i++) {
+    pool.Submit([data, &segments, glyph_width, i]() {
+      int id = data->segments_merged[i];
+      SplitMergedSegment(segments.contours[id], segments.bounding_rectangles[id], glyph_width, &data->segments_merged_pieces[i]);
+    });
+  }
+  pool.Wait();
+
+  int num_split = 0;
+  int num_pieces = 0;
+  for (int i = 0; i < data->segments_merged_pieces.size(); i++) {
+    num_split += !data->segments_merged_pieces[i].empty();
+    num_pieces += (int)data->segments_merged_pieces[i].size();
+  }
+  std::cout << ">> Split " << num_split << " of " << data->segments_merged.size() << " merged segments into " << num_pieces << " glyphs "
+            << "(glyph width " << glyph_width << " px)." << std::endl;
+}
+
+// Open the segment archive of a run (<output-dir>/segments.segarc) if the
+// segments are exported to an archive
+static bool OpenSegmentArchive(const Settings& settings, SegmentArchiveWriter* out_archive) {
+  if (settings.output_format != "archive") { return true; }
+  String path = settings.output_directory + "/segments.segarc";
+  std::filesystem::create_directories(settings.output_directory);
+  if (!out_archive->Open(path)) {
+    std::cout << "ERROR: could not create archive '" << path << "'." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Encoding of the segments in an archive
+static CropEncoding GetArchiveEncoding(const Settings& settings) {
+  if (settings.archive_encoding == "raw") { return CropEncoding::RAW; }
+  if (settings.archive_encoding == "png") { return CropEncoding::PNG; }
+  return CropEncoding::JPEG;
+}
+
+// Build the file name of an exported segment (e.g. output/correct/c00000000.jpg)
+static String SegmentFileName(const String& directory, char prefix, int i) {
+  std::stringstream ss_name;
+  ss_name << directory << "/" << prefix << std::setfill('0') << std::setw(8) << i << ".jpg";
+  return ss_name.str();
+}
+
 // Run segment exporting stage
 static void RunSegmentExportingStage(Data* data, Settings* settings) {
-  std::cout << "Step 5. Segment exporting" << std::endl;
+  std::cout << "Step 6. Segment exporting" << std::endl;
   std::cout << "================" << std::endl;
   std::cout << ">> Isolating segments and exporting to files." << std::endl
             << "================" << std::endl;
 
-  std::stringstream ss_dir;
-  std::cout << "   Exporting [Correct segments]: ... ";
-  ss_dir.clear();
-  ss_dir << settings->output_directory << "/correct";
-  for (int i = 0; i < data->contours_correct.size(); i++) {
-    std::stringstream ss_name;
-    ss_name << "c" << std::setfill('0') << std::setw(8) << i;
-    SaveSegment(data->input_image_3c, data->contours_correct[i], data->bounding_rectangles_correct[i], ss_dir.str(), ss_name.str(), settings->crop_margin);
+  SegmentArchiveWriter archive;
+  if (!OpenSegmentArchive(*settings, &archive)) { return; }
+  uint32_t source = archive.AddSource(settings->input_image_file);
+  ThreadPool pool(settings->num_threads);
+  SegmentExporter exporter(&pool, settings->output_format == "archive" ? &archive : nullptr, GetArchiveEncoding(*settings));
+
+  const SegmentTable& segments = data->segments;
+  std::cout << "   Exporting [Correct segments]: " << data->segments_correct.size() << std::endl;
+  // With -dedup-export only the first correct segment of a group of repeated
+  // glyphs is exported, the repeats are listed with the segment they repeat
+  std::ofstream duplicates;
+  std::vector<int> exported;
+  int num_repeats = 0;
+  if (settings->dedup_export) {
+    GroupGlyphs(data, settings);
+    exported.assign(segments.Size(), -1);
+    std::filesystem::create_directories(settings->output_directory);
+    duplicates.open(settings->output_directory + "/duplicates.csv");
+    duplicates << "segment,representative,x,y,width,height" << std::endl;
+  }
+  for (int i = 0; i < data->segments_correct.size(); i++) {
+    int id = data->segments_correct[i];
+    ExportTarget target = { SegmentFileName(settings->output_directory + "/correct", 'c', i), source, (int)Tag::CORRECT };
+    if (settings->dedup_export) {
+      int group = data->glyph_groups[id];
+      if (exported[group] >= 0) {
+        const Rect& r = segments.bounding_rectangles[id];
+        duplicates << target.file << "," << SegmentFileName(settings->output_directory + "/correct", 'c', exported[group]) << ","
+                   << r.x << "," << r.y << "," << r.width << "," << r.height << std::endl;
+        num_repeats++;
+        continue;
+      }
+      exported[group] = i;
+    }
+    exporter.ExportSegment(data->input_image, { segments.contours[id] }, segments.bounding_rectangles[id], settings->crop_margin, target);
+  }
+  if (settings->dedup_export) {
+    std::cout << "   Repeated glyphs listed in duplicates.csv: " << num_repeats << std::endl;
+    if (!duplicates) { std::cout << "ERROR: could not write '" << settings->output_directory << "/duplicates.csv'." << std::endl; }
   }
-  std::cout << "DONE" << std::endl;
 
-  std::cout << "   Exporting [Merged segments]: ... ";
-  ss_dir.clear();
-  ss_dir << settings->output_directory << "/merged";
-  for (int i = 0; i < data->contours_merged.size(); i++) {
-    std::stringstream ss_name;
-    ss_name << "m" << std::setfill('0') << std::setw(8) << i;
-    SaveSegment(data->input_image_3c, data->contours_merged[i], data->bounding_rectangles_merged[i], ss_dir.str(), ss_name.str(), settings->crop_margin);
+  std::cout << "   Exporting [Merged segments]: " << data->segments_merged.size() << std::endl;
+  for (int i = 0; i < data->segments_merged.size(); i++) {
+    int id = data->segments_merged[i];
+    ExportTarget target = { SegmentFileName(settings->output_directory + "/merged", 'm', i), source, (int)Tag::MERGED };
+    exporter.ExportSegment(data->input_image, { segments.contours[id] }, segments.bounding_rectangles[id], settings->crop_margin, target);
   }
+
+  // Pieces of split merged segments are cropped with the contour of the
+  // merged segment, clipped to the rectangle of the piece
+  int num_pieces = 0;
+  for (int i = 0; i < data->segments_merged_pieces.size(); i++) { num_pieces += (int)data->segments_merged_pieces[i].size(); }
+  std::cout << "   Exporting [Split merged segments]: " << num_pieces << std::endl;
+  for (int i = 0, piece = 0; i < data->segments_merged_pieces.size(); i++) {
+    int id = data->segments_merged[i];
+    for (const Rect& piece_rectangle : data->segments_merged_pieces[i]) {
+      ExportTarget target = { SegmentFileName(settings->output_directory + "/correct", 's', piece++), source, (int)Tag::CORRECT };
+      exporter.ExportSegment(data->input_image, { segments.contours[id] }, piece_rectangle, settings->crop_margin, target);
+    }
+  }
+
+  std::cout << "   Exporting [Merged partial segments]: " << data->partial_sets.size() << std::endl;
+  for (int i = 0; i < data->partial_sets.size(); i++) {
+    const std::vector<int>& ids = data->partial_sets[i];
+    ExportTarget target = { SegmentFileName(settings->output_directory + "/correct", 'p', i), source, (int)Tag::PARTIAL };
+    exporter.ExportSegment(data->input_image, segments.GetContours(ids), segments.GetBoundingRect(ids), settings->crop_margin, target);
+  }
+
+  std::cout << "   Writing segments: ... ";
+  exporter.Finish();
+  bool archive_written = archive.Close();
+  std::cout << "DONE (" << exporter.FilesWritten() << " segments)" << std::endl;
+  if (exporter.FilesFailed() > 0 || !archive_written) {
+    std::cout << "ERROR: segments could not be written to '" << settings->output_directory << "'." << std::endl;
+    return;
+  }
+  // The session is done, running the image again starts a new one
+  data->session.AppendComplete();
+  data->session.Close();
+}
+
+// Statistics gathered by the workers during a batch run
+struct BatchStatistics {
+  std::atomic<uint64> images{ 0 };
+  std::atomic<uint64> pixels{ 0 };
+  std::atomic<uint64> segments{ 0 };
+  std::atomic<uint64> failures{ 0 };
+  std::atomic<uint64> write_failures{ 0 };  // Segments that could not be written
+};
+
+// Buffers of a batch worker, reused from page to page
+struct BatchWorkspace {
+  Mat threshold_mask_image;
+  SegmentTable segments;
+  SegmentationWorkspace segmentation;
+};
+
+// Collect the images to process: a single image, all images in a directory, or
+// all images listed in a .txt file (one path per line)
+static std::vector<String> CollectInputFiles(const String& input) {
+  std::vector<String> files;
+  std::filesystem::path input_path(input);
+  if (std::filesystem::is_directory(input_path)) {
+    for (const auto& entry : std::filesystem::directory_iterator(input_path)) {
+      if (entry.is_regular_file() && IsImageFile(entry.path())) { files.push_back(entry.path().string()); }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+  if (input_path.extension() == ".txt") {
+    std::ifstream list(input);
+    String line;
+    while (std::getline(list, line)) {
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (!line.empty()) { files.push_back(line); }
+    }
+    return files;
+  }
+  files.push_back(input);
+  return files;
+}
+
+// Process a single image without user interaction. All segments that pass the
+// area filter are exported to <output-dir>/segments/<image name>, the pages of
+// a multi-page image to <output-dir>/segments/<image name>_p<page>.
+static void ProcessBatchImage(const String& file, const Settings& settings, SegmentExporter* exporter, SegmentArchiveWriter* archive, BatchStatistics* stats, BatchWorkspace* workspace) {
+  ProfileScope scope("ProcessBatchImage");
+  int num_pages = CountPages(file);
+  if (num_pages == 0) {
+    std::cerr << "ERROR: could not read image '" << file << "'" << std::endl;
+    stats->failures++;
+    return;
+  }
+  DecodeEachPage(file, num_pages, [&](int page_index, const DecodedPage& page) {
+    if (page.image.empty()) {
+      std::cerr << "ERROR: could not read page " << page_index << " of image '" << file << "'" << std::endl;
+      stats->failures++;
+      return;
+    }
+
+    // The segments can be reused for the next page, as the exporter has no
+    // pool and crops them before ExportSegment() returns
+    SegmentTable& segments = workspace->segments;
+    ThresholdImage(page.gray, settings, settings.threshold, settings.threshold_k, &workspace->threshold_mask_image);
+    PerformSegmentation(workspace->threshold_mask_image, settings.min_segment_area, &segments, &workspace->segmentation);
+
+    std::ostringstream name;
+    name << std::filesystem::path(file).stem().string();
+    if (num_pages > 1) { name << "_p" << std::setw(4) << std::setfill('0') << page_index + 1; }
+    String directory = settings.output_directory + "/segments/" + name.str();
+    uint32_t source = 0;
+    if (settings.output_format == "archive") { source = archive->AddSource(num_pages > 1 ? file + "#" + std::to_string(page_index) : file); }
+    else { std::filesystem::create_directories(directory); }
+    for (int i = 0; i < segments.Size(); i++) {
+      ExportTarget target = { SegmentFileName(directory, 's', i), source, -1, &stats->write_failures };
+      exporter->ExportSegment(page.image, { segments.contours[i] }, segments.bounding_rectangles[i], settings.crop_margin, target);
+    }
+
+    stats->images++;
+    stats->pixels += page.gray.total();
+    stats->segments += segments.Size();
+  });
+}
+
+// Segment a page in strips and export its segments (see ProcessBatchImageTiled)
+static void ProcessTiledPage(StripReader* reader, const String& file, int page_index, int num_pages, const Settings& settings, SegmentExporter* exporter, SegmentArchiveWriter* archive, BatchStatistics* stats) {
+  std::ostringstream name;
+  name << std::filesystem::path(file).stem().string();
+  if (num_pages > 1) { name << "_p" << std::setw(4) << std::setfill('0') << page_index + 1; }
+  String directory = settings.output_directory + "/segments/" + name.str();
+  uint32_t source = 0;
+  if (settings.output_format == "archive") { source = archive->AddSource(num_pages > 1 ? file + "#" + std::to_string(page_index) : file); }
+  else { std::filesystem::create_directories(directory); }
+  // Retain strips covering at least 256 rows, so most segments are cropped
+  // from memory and only taller ones are read again
+  int retained_strips = std::max(2, (256 + settings.tile_height - 1) / settings.tile_height);
+  uint64 num_segments = 0;
+  bool success = PerformTiledSegmentation(reader, settings.tile_height, settings.threshold, settings.min_segment_area, settings.crop_margin, retained_strips, [&](const TiledSegment& segment) {
+    ExportTarget target = { SegmentFileName(directory, 's', (int)num_segments++), source, -1, &stats->write_failures };
+    exporter->ExportImage(segment.crop, segment.bounding_rectangle, segment.crop_rectangle, target);
+  });
+  if (!success) {
+    std::cerr << "ERROR: could not read page " << page_index << " of image '" << file << "'" << std::endl;
+    stats->failures++;
+    return;
+  }
+
+  stats->images++;
+  stats->pixels += (uint64)reader->Width() * reader->Height();
+  stats->segments += num_segments;
+}
+
+// Process a single image in strips of rows, so memory is bounded by the strip
+// size instead of the page size. Segments are exported as soon as they are
+// complete, in the order in which they are completed. Every page of a
+// multi-page image is processed, with the layout of ProcessBatchImage. Pages
+// that cannot be streamed are decoded in full, with a warning.
+static void ProcessBatchImageTiled(const String& file, const Settings& settings, SegmentExporter* exporter, SegmentArchiveWriter* archive, BatchStatistics* stats) {
+  ProfileScope scope("ProcessBatchImageTiled");
+  int num_pages = CountPages(file);
+  if (num_pages == 0) {
+    std::cerr << "ERROR: could not read image '" << file << "'" << std::endl;
+    stats->failures++;
+    return;
+  }
+
+  // Decode all pages in a single pass if the first one cannot be streamed
+  std::unique_ptr<StripReader> reader = OpenStripReader(file, 0);
+  if (!reader) {
+    std::cerr << "WARNING: '" << file << "' cannot be streamed in strips, its pages are decoded in full." << std::endl;
+    DecodeEachPage(file, num_pages, [&](int page_index, const DecodedPage& page) {
+      if (page.gray.empty()) {
+        std::cerr << "ERROR: could not read page " << page_index << " of image '" << file << "'" << std::endl;
+        stats->failures++;
+        return;
+      }
+      DecodedStripReader decoded_reader(page.gray);
+      ProcessTiledPage(&decoded_reader, file, page_index, num_pages, settings, exporter, archive, stats);
+    });
+    return;
+  }
+  for (int page_index = 0; page_index < num_pages; page_index++) {
+    if (page_index > 0) { reader = OpenStripReader(file, page_index); }
+    if (reader) {
+      ProcessTiledPage(reader.get(), file, page_index, num_pages, settings, exporter, archive, stats);
+      continue;
+    }
+    DecodedPage page;
+    if (!DecodePage(file, page_index, &page)) {
+      std::cerr << "ERROR: could not read page " << page_index << " of image '" << file << "'" << std::endl;
+      stats->failures++;
+      continue;
+    }
+    std::cerr << "WARNING: page " << page_index << " of '" << file << "' cannot be streamed in strips, it is decoded in full." << std::endl;
+    DecodedStripReader decoded_reader(page.gray);
+    ProcessTiledPage(&decoded_reader, file, page_index, num_pages, settings, exporter, archive, stats);
+  }
+}
+
+// Run the headless batch mode, spreading the input images over a thread pool
+static int RunBatchMode(const Settings& settings) {
+  std::cout << "Batch mode" << std::endl;
+  std::cout << "================" << std::endl;
+  std::vector<String> files = CollectInputFiles(settings.input_image_file);
+  if (files.empty()) {
+    std::cout << "ERROR: no input images found in '" << settings.input_image_file << "'." << std::endl;
+    return 1;
+  }
+
+  // Parallelism comes from processing whole images concurrently, so keep
+  // OpenCV from spawning threads of its own inside every worker
+  setNumThreads(1);
+  ThreadPool pool(settings.num_threads);
+  std::vector<BatchWorkspace> workspaces(pool.NumThreads());
+  std::cout << ">> Processing " << files.size() << " images on " << pool.NumThreads() << " threads ... ";
+
+  // Workers crop and encode their own segments, a single writer thread
+  // writes the files
+  SegmentArchiveWriter archive;
+  if (!OpenSegmentArchive(settings, &archive)) { return 1; }
+  SegmentExporter exporter(nullptr, settings.output_format == "archive" ? &archive : nullptr, GetArchiveEncoding(settings));
+  BatchStatistics stats;
+  int64 start = getTickCount();
+  for (int i = 0; i < files.size(); i++) {
+    const String& file = files[i];
+    pool.Submit([&settings, &exporter, &archive, &stats, &workspaces, file]() {
+      // A corrupt image fails on its own instead of aborting the run
+      try {
+        if (settings.tile_height > 0) {
+          ProcessBatchImageTiled(file, settings, &exporter, &archive, &stats);
+        } else {
+          ProcessBatchImage(file, settings, &exporter, &archive, &stats, &workspaces[ThreadPool::CurrentWorker()]);
+        }
+      } catch (const std::exception& e) {
+        std::cerr << "ERROR: could not process image '" << file << "': " << e.what() << std::endl;
+        stats.failures++;
+      }
+    });
+  }
+  pool.Wait();
+  exporter.Finish();
+  bool archive_written = archive.Close();
+  double seconds = (getTickCount() - start) / getTickFrequency();
   std::cout << "DONE" << std::endl;
 
-  std::cout << "   Exporting [Merged partial segments]: ... ";
-  ss_dir.clear();
-  ss_dir << settings->output_directory << "/correct";
-  for (int i = 0; i < data->contours_partial_sets.size(); i++) {
-    std::stringstream ss_name;
-    ss_name << "p" << std::setfill('0') << std::setw(8) << i;
-    SaveMultiSegment(data->input_image_3c, data->contours_partial_sets[i], data->bounding_rectangles_partial_sets[i], ss_dir.str(), ss_name.str(), settings->crop_margin);
+  std::cout << "   Images processed: " << stats.images << " (" << stats.failures << " failed)" << std::endl
+            << "   Segments exported: " << stats.segments << std::endl
+            << "   Elapsed time: " << seconds << " s" << std::endl
+            << "   Throughput: " << stats.images / seconds << " images/s, "
+            << stats.pixels / seconds / 1e6 << " MP/s" << std::endl;
+  if (exporter.FilesFailed() > 0 || !archive_written) {
+    std::cout << "ERROR: segments could not be written to '" << settings.output_directory << "'." << std::endl;
+  }
+  return (stats.failures == 0 && exporter.FilesFailed() == 0 && archive_written) ? 0 : 1;
+}
+
+// Set when the daemon is asked to stop (SIGINT or SIGTERM)
+static volatile std::sig_atomic_t daemon_stop = 0;
+
+static void HandleStopSignal(int) { daemon_stop = 1; }
+
+// Run as a daemon that processes the pages dropped into a spool directory
+// like batch mode does, until it is stopped. The workers, their buffers and
+// the writer stay up between pages, so a page only costs its processing. When
+// the queue is full, new pages are left in the spool directory until a worker
+// is free.
+static int RunDaemonMode(const Settings& settings) {
+  std::cout << "Daemon mode" << std::endl;
+  std::cout << "================" << std::endl;
+  SpoolDirectory spool;
+  if (!spool.Open(settings.input_image_file)) {
+    std::cout << "ERROR: could not open spool directory '" << settings.input_image_file << "'." << std::endl;
+    return 1;
+  }
+
+  setNumThreads(1);
+  ThreadPool pool(settings.num_threads);
+  std::vector<BatchWorkspace> workspaces(pool.NumThreads());
+  size_t queue_size = settings.queue_size > 0 ? settings.queue_size : 2 * pool.NumThreads();
+  SegmentExporter exporter(nullptr);
+  BatchStatistics stats;
+  std::mutex mutex;
+  std::condition_variable job_finished;
+  size_t num_jobs = 0;
+  std::signal(SIGINT, HandleStopSignal);
+  std::signal(SIGTERM, HandleStopSignal);
+  std::cout << ">> Watching '" << settings.input_image_file << "' with " << pool.NumThreads() << " threads (queue of " << queue_size << " pages). Press [CTRL+C] to stop." << std::endl;
+
+  std::vector<String> files;
+  while (!daemon_stop) {
+    spool.Poll(&files);
+    for (const String& file : files) {
+      // Backpressure: wait for a free place in the queue
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (num_jobs >= queue_size && !daemon_stop) { job_finished.wait_for(lock, std::chrono::milliseconds(settings.poll_interval)); }
+        if (daemon_stop) { break; }
+        num_jobs++;
+      }
+      JobStatus status;
+      status.file = file;
+      spool.WriteStatus(status);
+      int64 queued = getTickCount();
+      pool.Submit([&, status, queued]() mutable {
+        int64 start = getTickCount();
+        status.state = JobState::PROCESSING;
+        status.queued_ms = (start - queued) * 1000.0 / getTickFrequency();
+        spool.WriteStatus(status);
+        std::shared_ptr<BatchStatistics> job = std::make_shared<BatchStatistics>();
+        try {
+          if (settings.tile_height > 0) {
+            ProcessBatchImageTiled(spool.Path(status.file), settings, &exporter, nullptr, job.get());
+          } else {
+            ProcessBatchImage(spool.Path(status.file), settings, &exporter, nullptr, job.get(), &workspaces[ThreadPool::CurrentWorker()]);
+          }
+        } catch (const std::exception& e) {
+          std::cerr << "ERROR: could not process image '" << status.file << "': " << e.what() << std::endl;
+          status.error = e.what();
+          job->failures++;
+        }
+
+        // The job is done once its segments are written, it fails if any of
+        // them could not be written
+        status.pages = job->images;
+        status.segments = job->segments;
+        bool success = job->failures == 0;
+        if (!success && status.error.empty()) { status.error = "could not read image"; }
+        stats.images += job->images;
+        stats.pixels += job->pixels;
+        stats.segments += job->segments;
+        stats.failures += job->failures;
+        exporter.Notify([&, job, status, start, success]() mutable {
+          if (success && job->write_failures > 0) {
+            success = false;
+            status.error = "could not write segments";
+            stats.failures++;
+          }
+          status.state = success ? JobState::DONE : JobState::FAILED;
+          status.processing_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+          spool.Release(status.file, success);
+          spool.WriteStatus(status);
+          std::cout << ">> " << status.file << ": " << (success ? "" : "FAILED, ") << status.segments << " segments in " << status.processing_ms << " ms" << std::endl;
+          std::lock_guard<std::mutex> lock(mutex);
+          num_jobs--;
+          job_finished.notify_one();
+        });
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(settings.poll_interval));
   }
+
+  std::cout << ">> Stopping, finishing the queued pages ... ";
+  pool.Wait();
+  exporter.Finish();
   std::cout << "DONE" << std::endl;
+  std::cout << "   Pages processed: " << stats.images << " (" << stats.failures << " failed)" << std::endl
+            << "   Segments exported: " << stats.segments << std::endl;
+  if (exporter.FilesFailed() > 0) {
+    std::cout << "ERROR: segments could not be written to '" << settings.output_directory << "'." << std::endl;
+  }
+  return exporter.FilesFailed() == 0 && stats.failures == 0 ? 0 : 1;
+}
+
+// Print the profile of the run and write its trace (<output-dir>/trace.json)
+static void WriteProfile(const Settings& settings) {
+  if (!settings.profile) { return; }
+  Profiler::Instance().PrintSummary();
+  String path = settings.output_directory + "/trace.json";
+  std::filesystem::create_directories(settings.output_directory);
+  if (!Profiler::Instance().WriteChromeTrace(path)) {
+    std::cout << "ERROR: could not write trace '" << path << "'." << std::endl;
+    return;
+  }
+  std::cout << ">> Trace written to '" << path << "' (open in chrome://tracing or Perfetto)." << std::endl;
 }
 
 // Run character segmentation procedure
@@ -452,17 +1253,32 @@ int main(int argc, char* argv[]) {
 
   // Parse command line arguments
   if (!ParseCommandLineArguments(argc, argv, &settings)) { return 1; }
+  Profiler::Instance().Enable(settings.profile);
+  if (settings.daemon) {
+    int result = RunDaemonMode(settings);
+    WriteProfile(settings);
+    return result;
+  }
+  if (settings.batch) {
+    int result = RunBatchMode(settings);
+    WriteProfile(settings);
+    return result;
+  }
 
   // Load image
-  data.input_image_3c = imread(settings.input_image_file, IMREAD_COLOR);
-  cvtColor(data.input_image_3c, data.input_image_1c, CV_BGR2GRAY);
+  if (!StartLoadingPage(&data, &settings)) { return 1; }
 
-  // Run the procedure
-  RunThresholdingStage(&data, &settings);
-  RunSegmentDetectionStage(&data, &settings);
+  // Run the procedure, a session that was interrupted resumes at tagging
+  if (!ResumeSession(&data, &settings)) {
+    if (!RunThresholdingStage(&data, &settings)) { return 1; }
+    RunSegmentDetectionStage(&data, &settings);
+    StartSession(&data, &settings);
+  }
   RunSegmentTaggingStage(&data, &settings);
   RunPartialSegmentMergingStage(&data, &settings);
+  RunMergedSegmentSplittingStage(&data, &settings);
   RunSegmentExportingStage(&data, &settings);
+  WriteProfile(settings);
 
   return 0;
 }
\ No newline at end of file
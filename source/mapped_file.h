@@ -0,0 +1,75 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+  MappedFile() {}
+  ~MappedFile() { Close(); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Map a file into memory, returns false if it cannot be opened or is empty
+  bool Open(const std::string& path) {
+    Close();
+#ifdef _WIN32
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) { return false; }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) { Close(); return false; }
+    size_ = (size_t)size.QuadPart;
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ == NULL) { Close(); return false; }
+    data_ = (const unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data_ == nullptr) { Close(); return false; }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return false; }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) { close(fd); return false; }
+    size_ = (size_t)info.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { size_ = 0; return false; }
+    data_ = (const unsigned char*)data;
+#endif
+    return true;
+  }
+
+  // Unmap the file
+  void Close() {
+#ifdef _WIN32
+    if (data_ != nullptr) { UnmapViewOfFile(data_); }
+    if (mapping_ != NULL) { CloseHandle(mapping_); }
+    if (file_ != INVALID_HANDLE_VALUE) { CloseHandle(file_); }
+    mapping_ = NULL;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_ != nullptr) { munmap((void*)data_, size_); }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const unsigned char* Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+private:
+  const unsigned char* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = NULL;
+#endif
+};
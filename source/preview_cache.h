@@ -0,0 +1,110 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace cv;
+
+// Previews rendered ahead of the operator. A producer thread renders the
+// previews following the one being shown into a ring of slots whose Mats are
+// reused, and keeps the last few around so moving back (undo) is immediate as
+// well. Asking for a preview that is ready only returns pointers to its slot.
+class PreviewCache {
+public:
+  // Renders preview number index (the preview and the preview with the
+  // segment drawn on it), called from the producer thread
+  typedef std::function<void(int index, Mat* out_preview, Mat* out_preview_contour)> RenderFunction;
+
+  explicit PreviewCache(int lookahead = 8, int history = 4)
+    : slots_(lookahead + history + 1), lookahead_(lookahead), producer_(&PreviewCache::ProducerLoop, this) {}
+
+  ~PreviewCache() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      changed_.notify_all();
+    }
+    producer_.join();
+  }
+
+  PreviewCache(const PreviewCache&) = delete;
+  PreviewCache& operator=(const PreviewCache&) = delete;
+
+  // Serve previews [0, count) of a new render function, dropping all previews
+  // rendered so far. Waits for a preview that is being rendered to finish.
+  void Reset(int count, RenderFunction render) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return !rendering_; });
+    for (int i = 0; i < slots_.size(); i++) { slots_[i].index = -1; }
+    count_ = count;
+    current_ = 0;
+    render_ = std::move(render);
+    changed_.notify_all();
+  }
+
+  // Get a preview, waiting for it if it is not rendered yet. The returned Mats
+  // stay valid and unchanged until the next call of Get() or Reset().
+  void Get(int index, const Mat** out_preview, const Mat** out_preview_contour) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    current_ = index;
+    changed_.notify_all();
+    Slot& slot = slots_[index % slots_.size()];
+    changed_.wait(lock, [&] { return slot.index == index; });
+    *out_preview = &slot.preview;
+    *out_preview_contour = &slot.preview_contour;
+  }
+
+private:
+  struct Slot {
+    int index = -1;
+    Mat preview;
+    Mat preview_contour;
+  };
+
+  // Next preview to render: the first one of [current, current + lookahead]
+  // that is missing. Slots of the previews before current are only reused
+  // once they have dropped out of the history.
+  bool NextToRender(int* out_index) const {
+    if (!render_) { return false; }
+    int end = (int)std::min<int64>((int64)current_ + lookahead_ + 1, count_);
+    for (int i = current_; i < end; i++) {
+      if (slots_[i % slots_.size()].index != i) {
+        *out_index = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void ProducerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      int index = 0;
+      changed_.wait(lock, [&] { return stop_ || NextToRender(&index); });
+      if (stop_) { return; }
+      Slot& slot = slots_[index % slots_.size()];
+      slot.index = -1;
+      rendering_ = true;
+      lock.unlock();
+      render_(index, &slot.preview, &slot.preview_contour);
+      lock.lock();
+      slot.index = index;
+      rendering_ = false;
+      changed_.notify_all();
+    }
+  }
+
+  std::vector<Slot> slots_;
+  int lookahead_;
+  int count_ = 0;
+  int current_ = 0;
+  RenderFunction render_;
+  bool rendering_ = false;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::thread producer_;
+};
@@ -0,0 +1,201 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace cv;
+
+// Built-in instrumentation: scoped timers and counters, written as a Chrome
+// trace (chrome://tracing, Perfetto) and as a summary table. Profiling is off
+// unless enabled, a disabled timer costs a single flag check. Every thread
+// records its timers into a buffer of its own, registered once under a lock,
+// and counters are atomics, so worker threads never wait for each other.
+
+// Counters of the work done
+enum class ProfileCounter {
+  PIXELS,              // Pixels thresholded
+  CONTOURS_FOUND,      // Connected components found
+  CONTOURS_FILTERED,   // Components removed by the area filter
+  BYTES_WRITTEN        // Bytes of exported segments
+};
+
+static const int kNumProfileCounters = (int)ProfileCounter::BYTES_WRITTEN + 1;
+
+// Name of a counter, as shown in the trace and summary
+static const char* ProfileCounterName(ProfileCounter counter) {
+  static const char* names[kNumProfileCounters] = { "pixels", "contours found", "contours filtered", "bytes written" };
+  return names[(int)counter];
+}
+
+// Peak resident set size of the process in bytes (0 if unknown)
+static uint64 PeakResidentBytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) { return 0; }
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+#ifdef __APPLE__
+  return (uint64)usage.ru_maxrss;
+#else
+  return (uint64)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+class Profiler {
+public:
+  // The profiler of the process
+  static Profiler& Instance() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  void Enable(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+  bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Record a timed scope of the calling thread (in ticks of getTickCount())
+  void Record(const char* name, int64 start, int64 end) {
+    thread_local ThreadEvents* events = nullptr;
+    if (events == nullptr) { events = RegisterThread(); }
+    events->events.push_back({ name, start, end });
+  }
+
+  // Add to a counter
+  void Count(ProfileCounter counter, uint64 amount) {
+    if (Enabled()) { counters_[(int)counter].fetch_add(amount, std::memory_order_relaxed); }
+  }
+
+  uint64 Counter(ProfileCounter counter) const { return counters_[(int)counter].load(std::memory_order_relaxed); }
+
+  // Write all recorded scopes as Chrome trace events (one track per thread),
+  // followed by the counters and the peak RSS. Call once the threads being
+  // profiled are idle.
+  bool WriteChromeTrace(const String& path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream file(path);
+    if (!file) { return false; }
+    double us_per_tick = 1e6 / getTickFrequency();
+    int64 end = start_;
+    file << "{\"traceEvents\":[" << std::endl;
+    file << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (const std::unique_ptr<ThreadEvents>& thread : threads_) {
+      file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread->index
+           << ",\"args\":{\"name\":\"thread " << thread->index << "\"}}";
+      first = false;
+      for (const Event& event : thread->events) {
+        file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread->index
+             << ",\"ts\":" << (event.start - start_) * us_per_tick << ",\"dur\":" << (event.end - event.start) * us_per_tick << "}";
+        end = std::max(end, event.end);
+      }
+    }
+    file << (first ? "" : ",\n") << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << (end - start_) * us_per_tick << ",\"args\":{";
+    for (int i = 0; i < kNumProfileCounters; i++) {
+      file << "\"" << ProfileCounterName((ProfileCounter)i) << "\":" << Counter((ProfileCounter)i) << ",";
+    }
+    file << "\"peak rss\":" << PeakResidentBytes() << "}}" << std::endl << "]}" << std::endl;
+    return (bool)file;
+  }
+
+  // Print the calls, total, mean and max time of every scope (summed over all
+  // threads, slowest first), the counters and the peak RSS
+  void PrintSummary() const {
+    struct Statistics {
+      uint64 calls = 0;
+      int64 total = 0;
+      int64 max = 0;
+    };
+    std::map<String, Statistics> scopes;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const std::unique_ptr<ThreadEvents>& thread : threads_) {
+        for (const Event& event : thread->events) {
+          Statistics& statistics = scopes[event.name];
+          statistics.calls++;
+          statistics.total += event.end - event.start;
+          statistics.max = std::max(statistics.max, event.end - event.start);
+        }
+      }
+    }
+    std::vector<std::pair<String, Statistics>> sorted(scopes.begin(), scopes.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<String, Statistics>& a, const std::pair<String, Statistics>& b) { return a.second.total > b.second.total; });
+
+    double ms_per_tick = 1e3 / getTickFrequency();
+    std::cout << "Profile" << std::endl;
+    std::cout << "================" << std::endl;
+    std::cout << std::left << std::setw(32) << "   Scope" << std::right << std::setw(10) << "Calls" << std::setw(14) << "Total (ms)" << std::setw(12) << "Mean (ms)" << std::setw(12) << "Max (ms)" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    for (const std::pair<String, Statistics>& scope : sorted) {
+      std::cout << "   " << std::left << std::setw(29) << scope.first << std::right << std::setw(10) << scope.second.calls
+                << std::setw(14) << scope.second.total * ms_per_tick << std::setw(12) << scope.second.total * ms_per_tick / scope.second.calls
+                << std::setw(12) << scope.second.max * ms_per_tick << std::endl;
+    }
+    for (int i = 0; i < kNumProfileCounters; i++) {
+      std::cout << "   " << std::left << std::setw(29) << ProfileCounterName((ProfileCounter)i) << std::right << std::setw(10) << Counter((ProfileCounter)i) << std::endl;
+    }
+    std::cout << "   " << std::left << std::setw(29) << "peak rss (MB)" << std::right << std::setw(10) << PeakResidentBytes() / (1 << 20) << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+  }
+
+private:
+  struct Event {
+    const char* name;
+    int64 start;
+    int64 end;
+  };
+
+  struct ThreadEvents {
+    int index;
+    std::vector<Event> events;
+  };
+
+  Profiler() : start_(getTickCount()) {
+    for (int i = 0; i < kNumProfileCounters; i++) { counters_[i] = 0; }
+  }
+
+  ThreadEvents* RegisterThread() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.push_back(std::unique_ptr<ThreadEvents>(new ThreadEvents()));
+    threads_.back()->index = (int)threads_.size() - 1;
+    return threads_.back().get();
+  }
+
+  int64 start_;
+  std::atomic<bool> enabled_{ false };
+  std::atomic<uint64> counters_[kNumProfileCounters];
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadEvents>> threads_;
+};
+
+// Times the scope it lives in (names must be string literals)
+class ProfileScope {
+public:
+  explicit ProfileScope(const char* name) : name_(name), start_(Profiler::Instance().Enabled() ? getTickCount() : 0) {}
+  ~ProfileScope() {
+    if (start_ != 0) { Profiler::Instance().Record(name_, start_, getTickCount()); }
+  }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+  const char* name_;
+  int64 start_;
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "mapped_file.h"
+
+using namespace cv;
+
+// Packed segment archive: a single append-only file holding many segment
+// crops, instead of one small image file per segment. Layout:
+//
+//   [header] [crop data ...] [index entries] [source names] [footer]
+//
+// Crops are appended with large sequential writes, the index (one entry per
+// crop) and the names of the source images are written when the archive is
+// closed, and the fixed-size footer at the very end points to both. Values
+// are stored in the byte order of the host (little endian on all supported
+// platforms).
+
+// Encoding of the crop data in an archive
+enum class CropEncoding : uint8_t {
+  RAW,  // 8-bit pixels, rows stored back to back
+  JPEG,
+  PNG
+};
+
+// Index entry of a single crop
+struct SegmentArchiveEntry {
+  uint64_t offset;          // Byte offset of the crop data in the file
+  uint64_t size;            // Byte size of the crop data
+  uint32_t source;          // Index of the source image
+  int32_t x, y, width, height;                      // Bounding rectangle of the segment in the source image
+  int32_t crop_x, crop_y, crop_width, crop_height;  // Rectangle of the crop in the source image
+  int8_t tag;               // Tag of the segment (-1 if untagged)
+  CropEncoding encoding;
+  uint8_t channels;
+  uint8_t reserved;
+};
+
+// Footer at the end of an archive
+struct SegmentArchiveFooter {
+  uint64_t index_offset;
+  uint64_t entry_count;
+  uint64_t sources_offset;
+  uint64_t source_count;
+  char magic[8];
+};
+
+static const char kSegmentArchiveMagic[8] = { 'J', 'S', 'E', 'G', 'A', 'R', 'C', '1' };
+
+// Writes a segment archive. Crops must be appended from a single thread.
+class SegmentArchiveWriter {
+public:
+  SegmentArchiveWriter() {}
+  ~SegmentArchiveWriter() { Close(); }
+
+  SegmentArchiveWriter(const SegmentArchiveWriter&) = delete;
+  SegmentArchiveWriter& operator=(const SegmentArchiveWriter&) = delete;
+
+  // Create an archive, data is written in blocks of the given size
+  bool Open(const String& path, size_t buffer_size = 8 << 20) {
+    file_ = std::fopen(path.c_str(), "wb");
+    if (file_ == nullptr) { return false; }
+    buffer_.reserve(buffer_size);
+    buffer_size_ = buffer_size;
+    offset_ = 0;
+    Write(kSegmentArchiveMagic, sizeof(kSegmentArchiveMagic));
+    return true;
+  }
+
+  // Register a source image, returns its index (may be called from any thread)
+  uint32_t AddSource(const String& name) {
+    std::lock_guard<std::mutex> lock(sources_mutex_);
+    sources_.push_back(name);
+    return (uint32_t)(sources_.size() - 1);
+  }
+
+  // Append a crop (encoded data, or raw pixel rows for CropEncoding::RAW)
+  void Append(uint32_t source, const Rect& bounding_rectangle, const Rect& crop_rectangle, int tag, CropEncoding encoding, int channels, const uchar* data, size_t size) {
+    SegmentArchiveEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.offset = offset_;
+    entry.size = size;
+    entry.source = source;
+    entry.x = bounding_rectangle.x;
+    entry.y = bounding_rectangle.y;
+    entry.width = bounding_rectangle.width;
+    entry.height = bounding_rectangle.height;
+    entry.crop_x = crop_rectangle.x;
+    entry.crop_y = crop_rectangle.y;
+    entry.crop_width = crop_rectangle.width;
+    entry.crop_height = crop_rectangle.height;
+    entry.tag = (int8_t)tag;
+    entry.encoding = encoding;
+    entry.channels = (uint8_t)channels;
+    entries_.push_back(entry);
+    Write(data, size);
+  }
+
+  // Write the index and footer and close the file. Returns false if any write failed.
+  bool Close() {
+    if (file_ == nullptr) { return ok_; }
+
+    // Align the index so entries can be read in place from a mapping
+    const uint64_t padding = 0;
+    Write(&padding, (8 - offset_ % 8) % 8);
+
+    SegmentArchiveFooter footer;
+    std::memset(&footer, 0, sizeof(footer));
+    footer.index_offset = offset_;
+    footer.entry_count = entries_.size();
+    Write(entries_.data(), entries_.size() * sizeof(SegmentArchiveEntry));
+    footer.sources_offset = offset_;
+    footer.source_count = sources_.size();
+    for (int i = 0; i < sources_.size(); i++) {
+      uint32_t length = (uint32_t)sources_[i].size();
+      Write(&length, sizeof(length));
+      Write(sources_[i].data(), length);
+    }
+    std::memcpy(footer.magic, kSegmentArchiveMagic, sizeof(footer.magic));
+    Write(&footer, sizeof(footer));
+    Flush();
+    ok_ = (std::fclose(file_) == 0) && ok_;
+    file_ = nullptr;
+    return ok_;
+  }
+
+  // Number of crops and bytes written so far
+  size_t NumEntries() const { return entries_.size(); }
+  uint64_t NumBytes() const { return offset_; }
+
+private:
+  // Buffer data, large blocks go straight to the file
+  void Write(const void* data, size_t size) {
+    offset_ += size;
+    if (buffer_.size() + size > buffer_size_) { Flush(); }
+    if (size >= buffer_size_) {
+      ok_ = (std::fwrite(data, 1, size, file_) == size) && ok_;
+      return;
+    }
+    buffer_.insert(buffer_.end(), (const uchar*)data, (const uchar*)data + size);
+  }
+
+  void Flush() {
+    if (buffer_.empty()) { return; }
+    ok_ = (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) == buffer_.size()) && ok_;
+    buffer_.clear();
+  }
+
+  FILE* file_ = nullptr;
+  std::vector<uchar> buffer_;
+  size_t buffer_size_ = 0;
+  uint64_t offset_ = 0;
+  bool ok_ = true;
+  std::vector<SegmentArchiveEntry> entries_;
+  std::mutex sources_mutex_;
+  std::vector<String> sources_;
+};
+
+// Reads a segment archive through a memory mapping. Raw crops are returned as
+// Mat headers pointing into the mapping, without copying any pixels (they stay
+// valid as long as the reader is open and must not be written to).
+class SegmentArchiveReader {
+public:
+  // Open an archive, returns false if it is missing or malformed. The footer,
+  // the source names and every index entry are validated, so the accessors
+  // below never read outside of the file.
+  bool Open(const String& path) {
+    entries_ = nullptr;
+    footer_.entry_count = 0;
+    sources_.clear();
+    if (!file_.Open(path) || file_.Size() < sizeof(kSegmentArchiveMagic) + sizeof(SegmentArchiveFooter)) { return false; }
+    SegmentArchiveFooter footer;
+    std::memcpy(&footer, file_.Data() + file_.Size() - sizeof(SegmentArchiveFooter), sizeof(SegmentArchiveFooter));
+    if (std::memcmp(footer.magic, kSegmentArchiveMagic, sizeof(footer.magic)) != 0) { return false; }
+
+    // Crop data, index and source names follow each other (the comparisons
+    // are ordered so that nothing can overflow)
+    uint64_t end = file_.Size() - sizeof(SegmentArchiveFooter);
+    if (footer.sources_offset > end || footer.index_offset > footer.sources_offset || footer.index_offset < sizeof(kSegmentArchiveMagic)) { return false; }
+    if (footer.index_offset % 8 != 0 || footer.entry_count > (footer.sources_offset - footer.index_offset) / sizeof(SegmentArchiveEntry)) { return false; }
+
+    // Read the source names
+    uint64_t offset = footer.sources_offset;
+    for (uint64_t i = 0; i < footer.source_count; i++) {
+      uint32_t length;
+      if (end - offset < sizeof(length)) { return false; }
+      std::memcpy(&length, file_.Data() + offset, sizeof(length));
+      offset += sizeof(length);
+      if (end - offset < length) { return false; }
+      sources_.push_back(String((const char*)file_.Data() + offset, length));
+      offset += length;
+    }
+
+    // Every crop lies in the crop data, refers to a known source and has a
+    // known encoding, raw crops hold exactly their pixels
+    const SegmentArchiveEntry* entries = (const SegmentArchiveEntry*)(file_.Data() + footer.index_offset);
+    for (uint64_t i = 0; i < footer.entry_count; i++) {
+      const SegmentArchiveEntry& entry = entries[i];
+      if (entry.offset < sizeof(kSegmentArchiveMagic) || entry.offset > footer.index_offset || entry.size > footer.index_offset - entry.offset) { return false; }
+      if (entry.source >= sources_.size() || entry.channels < 1 || entry.channels > 4) { return false; }
+      if (entry.encoding == CropEncoding::RAW) {
+        if (entry.crop_width <= 0 || entry.crop_height <= 0 || entry.size % entry.channels != 0) { return false; }
+        if ((uint64_t)entry.crop_width * (uint64_t)entry.crop_height != entry.size / entry.channels) { return false; }
+      } else if (entry.encoding == CropEncoding::JPEG || entry.encoding == CropEncoding::PNG) {
+        if (entry.size == 0 || entry.size > INT_MAX) { return false; }
+      } else {
+        return false;
+      }
+    }
+    footer_ = footer;
+    entries_ = entries;
+    return true;
+  }
+
+  // Number of crops in the archive
+  size_t NumEntries() const { return footer_.entry_count; }
+
+  // Index entry of a crop
+  const SegmentArchiveEntry& Entry(size_t i) const { return entries_[i]; }
+
+  // Name of a source image
+  const String& Source(uint32_t i) const { return sources_[i]; }
+
+  // Stored bytes of a crop (encoded data or raw pixel rows)
+  const uchar* Data(size_t i) const { return file_.Data() + entries_[i].offset; }
+
+  // Pixels of a crop: a view into the mapping for raw crops, decoded otherwise
+  Mat Crop(size_t i) const {
+    const SegmentArchiveEntry& entry = entries_[i];
+    if (entry.encoding == CropEncoding::RAW) {
+      return Mat(entry.crop_height, entry.crop_width, CV_8UC(entry.channels), (void*)Data(i));
+    }
+    return imdecode(Mat(1, (int)entry.size, CV_8U, (void*)Data(i)), IMREAD_UNCHANGED);
+  }
+
+private:
+  MappedFile file_;
+  SegmentArchiveFooter footer_{};
+  const SegmentArchiveEntry* entries_ = nullptr;
+  std::vector<String> sources_;
+};
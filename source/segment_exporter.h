@@ -0,0 +1,278 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "contour_store.h"
+#include "profiler.h"
+#include "segment_archive.h"
+#include "thread_pool.h"
+#include "utility.h"
+
+using namespace cv;
+
+// Crop a segment (one or more contours) out of an image. Pixels outside the
+// segment are white, as are pixels of the contours outside the bounding
+// rectangle (so a piece of a segment can be cropped with the contour of the
+// whole segment). The mask is a per-thread buffer that is reused.
+static void RenderSegment(const Mat& image, const std::vector<ContourView>& contours, const Rect& bounding_rectangle, int margin, Mat* out_output, Rect* out_crop_rectangle = nullptr) {
+  uint x1 = clip(bounding_rectangle.x - margin, 0, image.cols);
+  uint x2 = clip(bounding_rectangle.x + bounding_rectangle.width + margin, 0, image.cols);
+  uint y1 = clip(bounding_rectangle.y - margin, 0, image.rows);
+  uint y2 = clip(bounding_rectangle.y + bounding_rectangle.height + margin, 0, image.rows);
+
+  thread_local Mat mask;
+  mask.create(y2 - y1, x2 - x1, CV_8U);
+  mask.setTo(Scalar(0));
+  FillContours(mask, contours, Scalar(255), Point(-(int)x1, -(int)y1));
+  Rect inside = (bounding_rectangle - Point(x1, y1)) & Rect(0, 0, mask.cols, mask.rows);
+  mask.rowRange(0, inside.y).setTo(Scalar(0));
+  mask.rowRange(inside.y + inside.height, mask.rows).setTo(Scalar(0));
+  mask.colRange(0, inside.x).setTo(Scalar(0));
+  mask.colRange(inside.x + inside.width, mask.cols).setTo(Scalar(0));
+
+  out_output->create(y2 - y1, x2 - x1, image.type());
+  out_output->setTo(Scalar(255, 255, 255));
+  image(Rect(x1, y1, x2 - x1, y2 - y1)).copyTo(*out_output, mask);
+  if (out_crop_rectangle != nullptr) { *out_crop_rectangle = Rect(x1, y1, x2 - x1, y2 - y1); }
+}
+
+// Blocking queue with a fixed capacity (producers wait while it is full)
+template<typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  // Add an item, waiting for space if the queue is full
+  void Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+  }
+
+  // Take an item, waiting for one if the queue is empty. Returns false once
+  // the queue is closed and drained.
+  bool Pop(T* out_item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+    if (items_.empty()) { return false; }
+    *out_item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Signal that no more items will be pushed
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+private:
+  size_t capacity_;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  bool closed_ = false;
+};
+
+// Destination of an exported segment: the file it is written to, or its
+// source image and tag when exporting to an archive
+struct ExportTarget {
+  String file;
+  uint32_t source;
+  int tag;
+  std::atomic<uint64>* write_failures = nullptr;  // Counts a failed write if set (e.g. per job)
+};
+
+// Export pipeline for segments. Cropping/masking and encoding run on the
+// workers of a thread pool (or inline on the calling thread if there is no
+// pool), encoded segments go through a bounded queue to a dedicated writer
+// thread. That thread writes one image file per segment, or appends the
+// segments to an archive if one is given. File names are fixed by the caller,
+// so the output is deterministic whatever order the segments finish in.
+class SegmentExporter {
+public:
+  explicit SegmentExporter(ThreadPool* pool, SegmentArchiveWriter* archive = nullptr, CropEncoding archive_encoding = CropEncoding::JPEG, size_t queue_capacity = 256)
+    : pool_(pool), archive_(archive), archive_encoding_(archive_encoding), queue_(queue_capacity), writer_(&SegmentExporter::WriterLoop, this) {}
+
+  // Never throws (e.g. while another exception unwinds), an exception that
+  // was not rethrown by Finish() is reported instead
+  ~SegmentExporter() {
+    Drain();
+    if (!exception_) { return; }
+    try {
+      std::rethrow_exception(exception_);
+    } catch (const std::exception& e) {
+      std::cerr << "ERROR: could not export segments: " << e.what() << std::endl;
+    } catch (...) {
+      std::cerr << "ERROR: could not export segments." << std::endl;
+    }
+  }
+
+  SegmentExporter(const SegmentExporter&) = delete;
+  SegmentExporter& operator=(const SegmentExporter&) = delete;
+
+  // Export a segment made of one or more contours. The store the contours
+  // point into must stay alive and unchanged until Finish() returns.
+  void ExportSegment(const Mat& image, std::vector<ContourView> contours, const Rect& bounding_rectangle, int margin, const ExportTarget& target) {
+    Run([this, image, contours, bounding_rectangle, margin, target]() {
+      thread_local Mat output;
+      Rect crop_rectangle;
+      {
+        ProfileScope scope("RenderSegment");
+        RenderSegment(image, contours, bounding_rectangle, margin, &output, &crop_rectangle);
+      }
+      Encode(output, bounding_rectangle, crop_rectangle, target);
+    });
+  }
+
+  // Export a segment that is already cropped
+  void ExportImage(const Mat& crop, const Rect& bounding_rectangle, const Rect& crop_rectangle, const ExportTarget& target) {
+    Run([this, crop, bounding_rectangle, crop_rectangle, target]() { Encode(crop, bounding_rectangle, crop_rectangle, target); });
+  }
+
+  // Call a function on the writer thread once the segments exported so far by
+  // the calling thread are written. Only for exporters without a pool, whose
+  // segments are queued in the order they are exported.
+  void Notify(std::function<void()> callback) {
+    EncodedSegment marker;
+    marker.callback = std::move(callback);
+    queue_.Push(std::move(marker));
+  }
+
+  // Wait until all segments have been written and stop the writer. Rethrows
+  // the first exception thrown while cropping or encoding.
+  void Finish() {
+    Drain();
+    if (exception_) {
+      std::exception_ptr exception = exception_;
+      exception_ = nullptr;
+      std::rethrow_exception(exception);
+    }
+  }
+
+  // Number of segments written and failed so far, and the bytes written
+  uint64 FilesWritten() const { return files_written_; }
+  uint64 FilesFailed() const { return files_failed_; }
+  uint64 BytesWritten() const { return bytes_written_; }
+
+private:
+  // Wait until all segments have been written and stop the writer
+  void Drain() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return pending_ == 0; });
+    }
+    queue_.Close();
+    if (writer_.joinable()) { writer_.join(); }
+  }
+
+  struct EncodedSegment {
+    ExportTarget target;
+    Rect bounding_rectangle;
+    Rect crop_rectangle;
+    int channels;
+    std::vector<uchar> bytes;
+    std::function<void()> callback;  // Set for markers queued by Notify()
+  };
+
+  // Run a crop/encode job on the pool, or inline without a pool
+  template<typename F>
+  void Run(F job) {
+    if (pool_ == nullptr) {
+      job();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_++;
+    }
+    pool_->Submit([this, job]() {
+      try {
+        job();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!exception_) { exception_ = std::current_exception(); }
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0) { done_.notify_all(); }
+    });
+  }
+
+  // Encode a crop and queue it. Files are encoded in the format given by their
+  // extension, archived crops in the format of the archive.
+  void Encode(const Mat& crop, const Rect& bounding_rectangle, const Rect& crop_rectangle, const ExportTarget& target) {
+    EncodedSegment encoded;
+    encoded.target = target;
+    encoded.bounding_rectangle = bounding_rectangle;
+    encoded.crop_rectangle = crop_rectangle;
+    encoded.channels = crop.channels();
+    {
+      ProfileScope scope("EncodeSegment");
+      if (archive_ == nullptr) {
+        imencode(target.file.substr(target.file.find_last_of('.')), crop, encoded.bytes);
+      } else if (archive_encoding_ == CropEncoding::RAW) {
+        size_t row_size = crop.cols * crop.elemSize();
+        encoded.bytes.resize(row_size * crop.rows);
+        for (int y = 0; y < crop.rows; y++) { std::memcpy(encoded.bytes.data() + y * row_size, crop.ptr<uchar>(y), row_size); }
+      } else {
+        imencode(archive_encoding_ == CropEncoding::PNG ? ".png" : ".jpg", crop, encoded.bytes);
+      }
+    }
+    queue_.Push(std::move(encoded));
+  }
+
+  // Write the encoded segments in the order they arrive
+  void WriterLoop() {
+    EncodedSegment encoded;
+    while (queue_.Pop(&encoded)) {
+      if (encoded.callback) {
+        encoded.callback();
+        encoded.callback = nullptr;
+        continue;
+      }
+      ProfileScope scope("WriteSegment");
+      bool success = true;
+      if (archive_ != nullptr) {
+        archive_->Append(encoded.target.source, encoded.bounding_rectangle, encoded.crop_rectangle, encoded.target.tag, archive_encoding_, encoded.channels, encoded.bytes.data(), encoded.bytes.size());
+      } else {
+        FILE* file = std::fopen(encoded.target.file.c_str(), "wb");
+        success = file != nullptr && std::fwrite(encoded.bytes.data(), 1, encoded.bytes.size(), file) == encoded.bytes.size();
+        if (file != nullptr) { success = (std::fclose(file) == 0) && success; }
+      }
+      if (success) {
+        files_written_++;
+        bytes_written_ += encoded.bytes.size();
+        Profiler::Instance().Count(ProfileCounter::BYTES_WRITTEN, encoded.bytes.size());
+      } else {
+        files_failed_++;
+        if (encoded.target.write_failures != nullptr) { (*encoded.target.write_failures)++; }
+      }
+    }
+  }
+
+  ThreadPool* pool_;
+  SegmentArchiveWriter* archive_;
+  CropEncoding archive_encoding_;
+  BoundedQueue<EncodedSegment> queue_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+  size_t pending_ = 0;
+  std::exception_ptr exception_;
+  std::atomic<uint64> files_written_{ 0 };
+  std::atomic<uint64> files_failed_{ 0 };
+  std::atomic<uint64> bytes_written_{ 0 };
+  std::thread writer_;
+};
@@ -0,0 +1,162 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "contour_store.h"
+#include "segment_table.h"
+
+using namespace cv;
+
+// Layered rendering of segment outlines over a page, for the detection
+// preview. The base layer is the page reduced once to a pyramid level that
+// fits on screen, the contours are reduced to the same level once. Changing
+// the line thickness only redraws the overlay: the view is split into tiles
+// that are rendered in parallel, each tile copies its part of the base layer
+// and draws the outlines that reach into it. A zoomed view renders just the
+// visible part of the page, from the full-resolution image and contours.
+
+// Color of a segment, the same on every redraw (derived from its id)
+static Scalar SegmentColor(int id) {
+  uint32_t h = (uint32_t)id * 2654435761u;
+  h ^= h >> 15;
+  h *= 2246822519u;
+  h ^= h >> 13;
+  return Scalar(48 + (h & 0xFF) % 208, 48 + ((h >> 8) & 0xFF) % 208, 48 + ((h >> 16) & 0xFF) % 208);
+}
+
+class SegmentOverlay {
+public:
+  // Largest line thickness (in image pixels)
+  static constexpr int kMaxThickness = 16;
+
+  // Prepare the overlay of the segments of an image. The base layer is
+  // halved until its longest side is at most max_size pixels. The image and
+  // segment table must stay alive and unchanged while the overlay is used.
+  void Build(const Mat& image, const SegmentTable& segments, int max_size = 2048) {
+    image_ = image;
+    segments_ = &segments;
+    base_ = image;
+    scale_ = 1;
+    while (std::max(base_.cols, base_.rows) > max_size) {
+      pyrDown(base_, base_);
+      scale_ *= 2;
+    }
+    // Gray pages get a color base layer so the outlines show in color
+    if (base_.channels() == 1) { cvtColor(base_, base_, COLOR_GRAY2BGR); }
+
+    // Contours at the scale of the base layer, repeated points dropped
+    scaled_contours_.Clear();
+    scaled_rectangles_.resize(segments.Size());
+    std::vector<Point> scaled;
+    for (int i = 0; i < segments.Size(); i++) {
+      ContourView contour = segments.contours[i];
+      scaled.clear();
+      for (const Point& point : contour) {
+        Point p(point.x / scale_, point.y / scale_);
+        if (scaled.empty() || scaled.back() != p) { scaled.push_back(p); }
+      }
+      scaled_contours_.Add(scaled);
+      const Rect& r = segments.bounding_rectangles[i];
+      scaled_rectangles_[i] = Rect(r.x / scale_, r.y / scale_, r.width / scale_ + 1, r.height / scale_ + 1);
+    }
+    zoomed_base_.release();
+  }
+
+  // Size of the rendered view
+  Size ViewSize() const { return base_.size(); }
+
+  // Downscale factor of the base layer
+  int Scale() const { return scale_; }
+
+  // Region of the image shown at a zoom level (1 shows the whole image) around
+  // a center point (in image coordinates), kept inside the image
+  Rect ViewRegion(int zoom, Point2f center) const {
+    zoom = std::max(zoom, 1);
+    int width = std::max(image_.cols / zoom, 1);
+    int height = std::max(image_.rows / zoom, 1);
+    int x = std::min(std::max((int)center.x - width / 2, 0), image_.cols - width);
+    int y = std::min(std::max((int)center.y - height / 2, 0), image_.rows - height);
+    return Rect(x, y, width, height);
+  }
+
+  // Render the outlines of all segments with a line thickness (in image
+  // pixels) at a zoom level around a center point
+  void Render(int thickness, int zoom, Point2f center, Mat* out_view) {
+    Rect region = ViewRegion(zoom, center);
+    bool zoomed = region.size() != image_.size();
+    Size view_size = ViewSize();
+    double view_scale = (double)view_size.width / region.width;
+
+    // Base layer of a zoomed view, kept while only the thickness changes
+    const Mat* base = &base_;
+    if (zoomed) {
+      if (region != zoomed_region_ || zoomed_base_.empty()) {
+        resize(image_(region), zoomed_base_, view_size, 0, 0, view_scale < 1 ? INTER_AREA : INTER_NEAREST);
+        if (zoomed_base_.channels() == 1) { cvtColor(zoomed_base_, zoomed_base_, COLOR_GRAY2BGR); }
+        zoomed_region_ = region;
+      }
+      base = &zoomed_base_;
+    }
+
+    // Bin the visible segments into tiles, by their rectangles in the view
+    // widened by the line thickness
+    int view_thickness = std::max(1, (int)std::lround(std::min(thickness, kMaxThickness) * view_scale));
+    int pad = view_thickness / 2 + 1;
+    int columns = (view_size.width + kTileSize - 1) / kTileSize;
+    int rows = (view_size.height + kTileSize - 1) / kTileSize;
+    tiles_.assign(columns * rows, std::vector<int>());
+    for (int i = 0; i < segments_->Size(); i++) {
+      const Rect& r = segments_->bounding_rectangles[i];
+      if ((r & region).empty()) { continue; }
+      Rect v = zoomed ? Rect((int)((r.x - region.x) * view_scale), (int)((r.y - region.y) * view_scale), (int)(r.width * view_scale) + 1, (int)(r.height * view_scale) + 1)
+                      : scaled_rectangles_[i];
+      int x1 = std::max((v.x - pad) / kTileSize, 0);
+      int y1 = std::max((v.y - pad) / kTileSize, 0);
+      int x2 = std::min((v.x + v.width + pad) / kTileSize, columns - 1);
+      int y2 = std::min((v.y + v.height + pad) / kTileSize, rows - 1);
+      for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) { tiles_[y * columns + x].push_back(i); }
+      }
+    }
+
+    out_view->create(view_size, base->type());
+    parallel_for_(Range(0, columns * rows), [&](const Range& range) {
+      thread_local std::vector<Point> points;
+      for (int t = range.start; t < range.end; t++) {
+        Rect tile = Rect((t % columns) * kTileSize, (t / columns) * kTileSize, kTileSize, kTileSize) & Rect(Point(), view_size);
+        Mat tile_view = (*out_view)(tile);
+        (*base)(tile).copyTo(tile_view);
+        for (int id : tiles_[t]) {
+          // Points relative to the tile (at the scale of the view)
+          ContourView contour = zoomed ? segments_->contours[id] : scaled_contours_[id];
+          points.resize(contour.size());
+          for (int j = 0; j < contour.size(); j++) {
+            if (zoomed) {
+              points[j] = Point((int)((contour[j].x - region.x + 0.5) * view_scale) - tile.x, (int)((contour[j].y - region.y + 0.5) * view_scale) - tile.y);
+            } else {
+              points[j] = contour[j] - tile.tl();
+            }
+          }
+          const Point* p = points.data();
+          int count = (int)points.size();
+          polylines(tile_view, &p, &count, 1, true, SegmentColor(id), view_thickness, LINE_8);
+        }
+      }
+    });
+  }
+
+private:
+  static constexpr int kTileSize = 256;
+
+  Mat image_;
+  const SegmentTable* segments_ = nullptr;
+  Mat base_;
+  int scale_ = 1;
+  ContourStore scaled_contours_;
+  std::vector<Rect> scaled_rectangles_;
+  Mat zoomed_base_;
+  Rect zoomed_region_;
+  std::vector<std::vector<int>> tiles_;
+};
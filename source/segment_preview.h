@@ -0,0 +1,60 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <vector>
+#include "contour_store.h"
+#include "profiler.h"
+#include "segment_table.h"
+#include "utility.h"
+
+using namespace cv;
+
+// Copy the surroundings of a segment for a preview, in color (so the
+// highlighted segments show on gray pages too)
+static void CopySurroundings(const Mat& image, const Rect& rectangle, Mat* out_preview) {
+  if (image.channels() == 1) {
+    cvtColor(image(rectangle), *out_preview, COLOR_GRAY2BGR);
+  } else {
+    image(rectangle).copyTo(*out_preview);
+  }
+}
+
+// Generate a preview of a detected contour in its surroundings (the output
+// Mats are reused if they already have the right size)
+static void GeneratePreview(const Mat& image, const ContourView& contour, const Rect& bounding_rectangle, const Scalar& color, float surroundings_size, Mat* out_preview, Mat* out_preview_contour) {
+  ProfileScope scope("GeneratePreview");
+  int size = bounding_rectangle.width > bounding_rectangle.height ? bounding_rectangle.width : bounding_rectangle.height;
+  int size_surroundings = size * surroundings_size;
+  int x_center = bounding_rectangle.x + bounding_rectangle.width / 2;
+  int y_center = bounding_rectangle.y + bounding_rectangle.height / 2;
+
+  uint x1 = clip(x_center - size_surroundings, 0, image.cols);
+  uint x2 = clip(x_center + size_surroundings, 0, image.cols);
+  uint y1 = clip(y_center - size_surroundings, 0, image.rows);
+  uint y2 = clip(y_center + size_surroundings, 0, image.rows);
+
+  CopySurroundings(image, Rect(x1, y1, x2 - x1, y2 - y1), out_preview);
+  out_preview->copyTo(*out_preview_contour);
+  FillContours(*out_preview_contour, { contour }, color, Point(-(int)x1, -(int)y1));
+}
+
+// Generate a preview of multiple segments in their surroundings (the output
+// Mats are reused if they already have the right size)
+static void GenerateMultiPreview(const Mat& image, const SegmentTable& segments, const std::vector<int>& ids, const std::vector<Scalar>& colors, float surroundings_size, Mat* out_preview, Mat* out_preview_contour) {
+  ProfileScope scope("GeneratePreview");
+  Rect combined_bounding_rectangle = segments.GetBoundingRect(ids);
+  int size = combined_bounding_rectangle.width > combined_bounding_rectangle.height ? combined_bounding_rectangle.width : combined_bounding_rectangle.height;
+  int size_surroundings = size * surroundings_size;
+  int x_center = combined_bounding_rectangle.x + combined_bounding_rectangle.width / 2;
+  int y_center = combined_bounding_rectangle.y + combined_bounding_rectangle.height / 2;
+
+  uint x1 = clip(x_center - size_surroundings, 0, image.cols);
+  uint x2 = clip(x_center + size_surroundings, 0, image.cols);
+  uint y1 = clip(y_center - size_surroundings, 0, image.rows);
+  uint y2 = clip(y_center + size_surroundings, 0, image.rows);
+
+  CopySurroundings(image, Rect(x1, y1, x2 - x1, y2 - y1), out_preview);
+  out_preview->copyTo(*out_preview_contour);
+  for (int i = 0; i < ids.size(); i++) {
+    FillContours(*out_preview_contour, { segments.contours[ids[i]] }, colors[i], Point(-(int)x1, -(int)y1));
+  }
+}
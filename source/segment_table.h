@@ -0,0 +1,67 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <vector>
+#include "contour_store.h"
+
+using namespace cv;
+
+// Tags that can be assigned to a segment
+enum class Tag {
+  NOISE,
+  PARTIAL,
+  MERGED,
+  CORRECT,
+  UNTAGGED
+};
+
+// Number of tags (including UNTAGGED)
+static const int kNumTags = (int)Tag::UNTAGGED + 1;
+
+// Name of a tag, as shown to the operator
+static const char* TagName(Tag tag) {
+  static const char* names[kNumTags] = { "NOISE", "PARTIAL", "MERGED", "CORRECT", "UNTAGGED" };
+  return names[(int)tag];
+}
+
+// Segments found in an image, stored column-wise. The index of a segment in
+// the table is its id: the table is filled once (sorted by area) and segments
+// are never erased or reordered afterwards. Stages that select segments work
+// on lists of ids instead of moving the segment data around.
+struct SegmentTable {
+  ContourStore contours;
+  std::vector<uint> areas;
+  std::vector<Rect> bounding_rectangles;
+  std::vector<Tag> tags;
+
+  // Number of segments
+  int Size() const { return (int)areas.size(); }
+
+  // Remove all segments
+  void Clear() {
+    contours.Clear();
+    areas.clear();
+    bounding_rectangles.clear();
+    tags.clear();
+  }
+
+  // Partition the segment ids by tag in a single pass. The ids of tag t end up
+  // in (*out_partitions)[(int)t], in increasing order (so still sorted by area).
+  void PartitionByTag(std::vector<std::vector<int>>* out_partitions) const {
+    out_partitions->assign(kNumTags, std::vector<int>());
+    for (int i = 0; i < tags.size(); i++) { (*out_partitions)[(int)tags[i]].push_back(i); }
+  }
+
+  // Bounding rectangle of a set of segments
+  Rect GetBoundingRect(const std::vector<int>& ids) const {
+    Rect combined_bounding_rectangle = bounding_rectangles[ids[0]];
+    for (int i = 1; i < ids.size(); i++) { combined_bounding_rectangle |= bounding_rectangles[ids[i]]; }
+    return combined_bounding_rectangle;
+  }
+
+  // Views of the contours of a set of segments
+  std::vector<ContourView> GetContours(const std::vector<int>& ids) const {
+    std::vector<ContourView> result;
+    for (int i = 0; i < ids.size(); i++) { result.push_back(contours[ids[i]]); }
+    return result;
+  }
+};
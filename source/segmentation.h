@@ -0,0 +1,113 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <vector>
+#include "connected_components.h"
+#include "profiler.h"
+#include "segment_table.h"
+#include "sort_permutation.h"
+
+using namespace cv;
+
+// Perform thresholding to separate characters from background (a negative
+// threshold selects one automatically using Otsu's method)
+static void PerformThresholding(const Mat& image, int t, Mat* out_threshold_mask) {
+  ProfileScope scope("PerformThresholding");
+  Profiler::Instance().Count(ProfileCounter::PIXELS, image.total());
+  if (t < 0) {
+    threshold(image, *out_threshold_mask, 0, 255, THRESH_BINARY | THRESH_OTSU);
+    return;
+  }
+  threshold(image, *out_threshold_mask, t, 255, THRESH_BINARY);
+}
+
+// Add the pixel values of an 8-bit image to a 256-bin histogram
+static void AccumulateHistogram(const Mat& image, std::vector<uint64>* histogram) {
+  for (int y = 0; y < image.rows; y++) {
+    const uchar* row = image.ptr<uchar>(y);
+    for (int x = 0; x < image.cols; x++) { (*histogram)[row[x]]++; }
+  }
+}
+
+// Select a threshold using Otsu's method on a 256-bin histogram
+static int ComputeOtsuThreshold(const std::vector<uint64>& histogram) {
+  double total = 0;
+  double sum = 0;
+  for (int i = 0; i < 256; i++) {
+    total += histogram[i];
+    sum += (double)i * histogram[i];
+  }
+  double weight_background = 0;
+  double sum_background = 0;
+  double best_variance = -1;
+  int best_threshold = 0;
+  for (int t = 0; t < 256; t++) {
+    weight_background += histogram[t];
+    sum_background += (double)t * histogram[t];
+    double weight_foreground = total - weight_background;
+    if (weight_background == 0 || weight_foreground == 0) { continue; }
+    double mean_background = sum_background / weight_background;
+    double mean_foreground = (sum - sum_background) / weight_foreground;
+    double variance = weight_background * weight_foreground * (mean_background - mean_foreground) * (mean_background - mean_foreground);
+    if (variance > best_variance) {
+      best_variance = variance;
+      best_threshold = t;
+    }
+  }
+  return best_threshold;
+}
+
+// Buffers of the segmentation, for callers that segment page after page and
+// keep them to reuse
+struct SegmentationWorkspace {
+  ConnectedComponents components;
+  std::vector<int> kept;
+  LabelingScratch labeling;
+};
+
+// Perform segmentation to find individual characters. Segments are sorted by
+// area (largest first), the area is the number of pixels in the segment. All
+// segments start out untagged. Without a workspace, temporary buffers are used.
+static void PerformSegmentation(const Mat& image_thresholded, uint min_area, SegmentTable* out_segments, SegmentationWorkspace* workspace = nullptr) {
+  ProfileScope scope("PerformSegmentation");
+  SegmentationWorkspace temporary;
+  SegmentationWorkspace& buffers = workspace != nullptr ? *workspace : temporary;
+  ConnectedComponents& components = buffers.components;
+  std::vector<int>& kept = buffers.kept;
+  kept.clear();
+  {
+    ProfileScope scope("Segmentation: labeling");
+    LabelConnectedComponents(image_thresholded, &components, nullptr, &buffers.labeling);
+  }
+
+  // Keep the components that pass the area filter
+  {
+    ProfileScope scope("Segmentation: metadata");
+    out_segments->Clear();
+    for (int i = 0; i < components.areas.size(); i++) {
+      if (components.areas[i] < min_area) { continue; }
+      kept.push_back(i);
+      out_segments->areas.push_back(components.areas[i]);
+      out_segments->bounding_rectangles.push_back(components.bounding_rectangles[i]);
+    }
+    Profiler::Instance().Count(ProfileCounter::CONTOURS_FOUND, components.areas.size());
+    Profiler::Instance().Count(ProfileCounter::CONTOURS_FILTERED, components.areas.size() - kept.size());
+  }
+
+  // Sort segments and their metadata by area
+  {
+    ProfileScope scope("Segmentation: sort");
+    auto p = sort_permutation(out_segments->areas, std::greater<uint>());
+    apply_permutation_in_place(p, kept, out_segments->areas, out_segments->bounding_rectangles);
+  }
+
+  // Only trace contours for the segments that are kept, the half perimeter of
+  // the bounding rectangle is a good guess for the number of contour points
+  ProfileScope contour_scope("Segmentation: contours");
+  size_t num_points = 0;
+  for (int i = 0; i < kept.size(); i++) { num_points += out_segments->bounding_rectangles[i].width + out_segments->bounding_rectangles[i].height; }
+  out_segments->contours.Reserve(kept.size(), num_points);
+  out_segments->tags.assign(kept.size(), Tag::UNTAGGED);
+  for (int i = 0; i < kept.size(); i++) {
+    ExtractComponentContour(components, kept[i], &out_segments->contours);
+  }
+}
@@ -0,0 +1,273 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "adaptive_threshold.h"
+#include "mapped_file.h"
+#include "segment_table.h"
+
+using namespace cv;
+
+// Session checkpoint of an interactive run, so an interrupted tagging session
+// can be resumed without thresholding and segmenting the image again. The
+// file is a log of records:
+//
+//   [magic] [snapshot] [tag | partial set] ... [complete]
+//
+// The snapshot holds the threshold and the segment table (rectangles, areas
+// and the flat contour point buffer) and is written once after segmentation.
+// Every tag given by hand (automatic tags are computed again on resuming, an
+// UNTAGGED record undoes a tag) and every completed partial set is appended
+// as a small record.
+// Once the segments are exported, a final record marks the session complete
+// so it is not resumed.
+// Records are flushed to the OS right away and synced to disk in batches, a
+// record torn by a crash is dropped on loading. Values are stored in the byte
+// order of the host, like in segment archives.
+
+// Types of the records in a session checkpoint
+enum class SessionRecord : uint32_t {
+  SNAPSHOT = 1,
+  TAG = 2,          // int32 id, int32 tag
+  PARTIAL_SET = 3,  // int32 count, int32 ids[count]
+  COMPLETE = 4      // No payload
+};
+
+// Header of every record
+struct SessionRecordHeader {
+  SessionRecord type;
+  uint32_t size;  // Byte size of the payload that follows
+};
+
+// Start of the snapshot payload, followed by the source name, the rectangles,
+// the areas, num_segments + 1 contour offsets and the contour points
+struct SessionSnapshotHeader {
+  int32_t image_width, image_height;
+  int32_t threshold_mode;
+  int32_t threshold;
+  float threshold_k;
+  uint32_t num_segments;
+  uint64_t num_points;
+  uint32_t source_length;
+  uint32_t reserved;
+};
+
+static const char kSessionCheckpointMagic[8] = { 'J', 'S', 'E', 'S', 'S', 'C', 'K', '1' };
+
+// State of a session read back from a checkpoint
+struct SessionCheckpoint {
+  String source;
+  Size image_size;
+  ThresholdMode threshold_mode;
+  int threshold;
+  float threshold_k;
+  SegmentTable segments;
+  std::vector<std::vector<int>> partial_sets;
+  bool complete = false;  // The segments of the session have been exported
+  size_t valid_size;      // Bytes up to the end of the last complete record
+};
+
+// Load a session checkpoint: map the file, copy the snapshot into the segment
+// table and replay the records. Returns false if there is no valid snapshot.
+static bool LoadSessionCheckpoint(const String& path, SessionCheckpoint* out_checkpoint) {
+  MappedFile file;
+  if (!file.Open(path)) { return false; }
+  const unsigned char* data = file.Data();
+  size_t size = file.Size();
+  if (size < sizeof(kSessionCheckpointMagic) || std::memcmp(data, kSessionCheckpointMagic, sizeof(kSessionCheckpointMagic)) != 0) { return false; }
+
+  size_t offset = sizeof(kSessionCheckpointMagic);
+  bool has_snapshot = false;
+  SegmentTable& segments = out_checkpoint->segments;
+  out_checkpoint->partial_sets.clear();
+  while (offset + sizeof(SessionRecordHeader) <= size) {
+    SessionRecordHeader header;
+    std::memcpy(&header, data + offset, sizeof(header));
+    const unsigned char* payload = data + offset + sizeof(header);
+    if (header.size > size - offset - sizeof(header)) { break; } // Torn record
+
+    if (header.type == SessionRecord::SNAPSHOT && !has_snapshot) {
+      SessionSnapshotHeader snapshot;
+      if (header.size < sizeof(snapshot)) { return false; }
+      std::memcpy(&snapshot, payload, sizeof(snapshot));
+      size_t n = snapshot.num_segments;
+      size_t expected = sizeof(snapshot) + snapshot.source_length + n * (sizeof(Rect) + sizeof(uint) + sizeof(int)) + sizeof(int) + snapshot.num_points * sizeof(Point);
+      if (header.size != expected) { return false; }
+      const unsigned char* p = payload + sizeof(snapshot);
+      out_checkpoint->source.assign((const char*)p, snapshot.source_length);
+      p += snapshot.source_length;
+      out_checkpoint->image_size = Size(snapshot.image_width, snapshot.image_height);
+      out_checkpoint->threshold_mode = (ThresholdMode)snapshot.threshold_mode;
+      out_checkpoint->threshold = snapshot.threshold;
+      out_checkpoint->threshold_k = snapshot.threshold_k;
+      segments.Clear();
+      segments.bounding_rectangles.resize(n);
+      segments.areas.resize(n);
+      segments.tags.assign(n, Tag::UNTAGGED);
+      std::memcpy(segments.bounding_rectangles.data(), p, n * sizeof(Rect));
+      p += n * sizeof(Rect);
+      std::memcpy(segments.areas.data(), p, n * sizeof(uint));
+      p += n * sizeof(uint);
+      std::vector<int> offsets(n + 1);
+      std::memcpy(offsets.data(), p, (n + 1) * sizeof(int));
+      p += (n + 1) * sizeof(int);
+      if (offsets[0] != 0 || offsets[n] != (int64)snapshot.num_points) { return false; }
+      segments.contours.Assign((const Point*)p, snapshot.num_points, offsets.data(), (int)n);
+      has_snapshot = true;
+    } else if (!has_snapshot) {
+      return false;
+    } else if (header.type == SessionRecord::TAG && header.size == 2 * sizeof(int32_t)) {
+      int32_t values[2];
+      std::memcpy(values, payload, sizeof(values));
+      if (values[0] < 0 || values[0] >= segments.Size() || values[1] < 0 || values[1] >= kNumTags) { break; }
+      segments.tags[values[0]] = (Tag)values[1];
+    } else if (header.type == SessionRecord::PARTIAL_SET && header.size >= sizeof(int32_t)) {
+      int32_t count;
+      std::memcpy(&count, payload, sizeof(count));
+      if (count <= 0 || header.size != (1 + (size_t)count) * sizeof(int32_t)) { break; }
+      std::vector<int> ids(count);
+      std::memcpy(ids.data(), payload + sizeof(count), count * sizeof(int32_t));
+      if (std::any_of(ids.begin(), ids.end(), [&](int id) { return id < 0 || id >= segments.Size(); })) { break; }
+      out_checkpoint->partial_sets.push_back(ids);
+    } else if (header.type == SessionRecord::COMPLETE && header.size == 0) {
+      out_checkpoint->complete = true;
+    } else {
+      break;
+    }
+    offset += sizeof(header) + header.size;
+  }
+  out_checkpoint->valid_size = offset;
+  return has_snapshot;
+}
+
+// Writes a session checkpoint. Without an open file all appends are ignored,
+// so stages can log unconditionally.
+class SessionCheckpointWriter {
+public:
+  SessionCheckpointWriter() {}
+  ~SessionCheckpointWriter() { Close(); }
+
+  SessionCheckpointWriter(const SessionCheckpointWriter&) = delete;
+  SessionCheckpointWriter& operator=(const SessionCheckpointWriter&) = delete;
+
+  // Create a new checkpoint holding the snapshot of a session
+  bool Create(const String& path, const String& source, const Size& image_size, ThresholdMode threshold_mode, int threshold, float threshold_k, const SegmentTable& segments) {
+    Close();
+    size_t n = segments.Size();
+    SessionSnapshotHeader snapshot;
+    std::memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.image_width = image_size.width;
+    snapshot.image_height = image_size.height;
+    snapshot.threshold_mode = (int32_t)threshold_mode;
+    snapshot.threshold = threshold;
+    snapshot.threshold_k = threshold_k;
+    snapshot.num_segments = (uint32_t)n;
+    snapshot.num_points = segments.contours.NumPoints();
+    snapshot.source_length = (uint32_t)source.size();
+    size_t payload_size = sizeof(snapshot) + source.size() + n * (sizeof(Rect) + sizeof(uint) + sizeof(int)) + sizeof(int) + snapshot.num_points * sizeof(Point);
+    if (payload_size > UINT32_MAX) { return false; }
+
+    file_ = std::fopen(path.c_str(), "wb");
+    if (file_ == nullptr) { return false; }
+    SessionRecordHeader header = { SessionRecord::SNAPSHOT, (uint32_t)payload_size };
+    ok_ = std::fwrite(kSessionCheckpointMagic, sizeof(kSessionCheckpointMagic), 1, file_) == 1;
+    Write(&header, sizeof(header));
+    Write(&snapshot, sizeof(snapshot));
+    Write(source.data(), source.size());
+    Write(segments.bounding_rectangles.data(), n * sizeof(Rect));
+    Write(segments.areas.data(), n * sizeof(uint));
+    Write(segments.contours.OffsetData(), (n + 1) * sizeof(int));
+    Write(segments.contours.PointData(), snapshot.num_points * sizeof(Point));
+    Sync();
+    return ok_;
+  }
+
+  // Continue a loaded checkpoint, dropping a torn record at its end
+  bool Resume(const String& path, const SessionCheckpoint& checkpoint) {
+    Close();
+    std::error_code error;
+    std::filesystem::resize_file(path, checkpoint.valid_size, error);
+    if (error) { return false; }
+    file_ = std::fopen(path.c_str(), "ab");
+    ok_ = file_ != nullptr;
+    last_sync_ = getTickCount();
+    return ok_;
+  }
+
+  // Append the tag of a segment
+  void AppendTag(int id, Tag tag) {
+    int32_t values[2] = { id, (int32_t)tag };
+    AppendRecord(SessionRecord::TAG, values, sizeof(values));
+  }
+
+  // Append a completed partial set
+  void AppendPartialSet(const std::vector<int>& ids) {
+    record_.clear();
+    record_.push_back((int32_t)ids.size());
+    record_.insert(record_.end(), ids.begin(), ids.end());
+    AppendRecord(SessionRecord::PARTIAL_SET, record_.data(), record_.size() * sizeof(int32_t));
+  }
+
+  // Mark the session complete (after its segments are exported) and sync
+  void AppendComplete() {
+    AppendRecord(SessionRecord::COMPLETE, nullptr, 0);
+    if (file_ != nullptr) { Sync(); }
+  }
+
+  // Sync all records to disk and close the file. Returns false if any write failed.
+  bool Close() {
+    if (file_ == nullptr) { return ok_; }
+    Sync();
+    ok_ = (std::fclose(file_) == 0) && ok_;
+    file_ = nullptr;
+    return ok_;
+  }
+
+  bool IsOpen() const { return file_ != nullptr; }
+
+private:
+  // Records are synced to disk after this many records or seconds
+  static const int kSyncRecords = 64;
+  static constexpr double kSyncSeconds = 2.0;
+
+  // Write a record and hand it to the OS, so it survives the process being
+  // killed. Syncing to disk (surviving a power loss) is batched.
+  void AppendRecord(SessionRecord type, const void* payload, size_t size) {
+    if (file_ == nullptr) { return; }
+    SessionRecordHeader header = { type, (uint32_t)size };
+    Write(&header, sizeof(header));
+    Write(payload, size);
+    ok_ = (std::fflush(file_) == 0) && ok_;
+    if (++unsynced_records_ >= kSyncRecords || (getTickCount() - last_sync_) / getTickFrequency() >= kSyncSeconds) { Sync(); }
+  }
+
+  void Write(const void* data, size_t size) {
+    if (size > 0) { ok_ = (std::fwrite(data, size, 1, file_) == 1) && ok_; }
+  }
+
+  void Sync() {
+    ok_ = (std::fflush(file_) == 0) && ok_;
+#ifdef _WIN32
+    ok_ = (_commit(_fileno(file_)) == 0) && ok_;
+#else
+    ok_ = (fsync(fileno(file_)) == 0) && ok_;
+#endif
+    unsynced_records_ = 0;
+    last_sync_ = getTickCount();
+  }
+
+  std::FILE* file_ = nullptr;
+  bool ok_ = true;
+  int unsynced_records_ = 0;
+  int64 last_sync_ = 0;
+  std::vector<int32_t> record_;
+};
@@ -1,15 +1,24 @@
-#include <vector>
+#pragma once
+#include <algorithm>
+#include <functional>
 #include <numeric>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 // Algorithms for finding a permutation that would sort a vector. Used to sort
 // multiple vectors based on the order of a single vector. 
 // Source: https://stackoverflow.com/questions/17074324/how-can-i-sort-two-vectors-in-the-same-way-with-criteria-that-uses-only-one-of
 
-// Find the permutation required to sort a vector
+// Integral keys (other than bool) are sorted with a radix sort
+template <typename T>
+using enable_if_radix_sortable = std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, std::vector<std::size_t>>;
+
+// Find the permutation required to sort a vector (generic comparator)
 template <typename T, typename Compare>
 std::vector<std::size_t> sort_permutation(
   const std::vector<T>& vec,
-  Compare& compare)
+  const Compare& compare)
 {
   std::vector<std::size_t> p(vec.size());
   std::iota(p.begin(), p.end(), 0);
@@ -18,14 +27,92 @@ std::vector<std::size_t> sort_permutation(
   return p;
 }
 
-// Apply a permutation to a vector
+// Find the permutation required to sort a vector of integers using a stable
+// LSD radix sort on 8-bit digits. The histograms of all digits are built in a
+// single read of the keys, and passes over digits that are equal for all keys
+// (e.g. the high bytes of small areas) are skipped.
+template <typename T>
+typename enable_if_radix_sortable<T>::type radix_sort_permutation(
+  const std::vector<T>& vec,
+  bool descending = false)
+{
+  typedef typename std::make_unsigned<T>::type Key;
+  const std::size_t n = vec.size();
+  const int num_passes = sizeof(Key);
+
+  // Map the keys so that unsigned ascending order is the requested order
+  Key flip = 0;
+  if (std::is_signed<T>::value) { flip ^= Key(Key(1) << (8 * sizeof(Key) - 1)); }
+  if (descending) { flip ^= Key(~Key(0)); }
+
+  std::vector<Key> keys(n);
+  std::vector<Key> keys_next(n);
+  std::vector<std::size_t> p(n);
+  std::vector<std::size_t> p_next(n);
+  std::vector<std::size_t> counts(num_passes * 256, 0);
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    keys[i] = Key(vec[i]) ^ flip;
+    p[i] = i;
+    for (int pass = 0; pass < num_passes; ++pass)
+    {
+      ++counts[pass * 256 + ((keys[i] >> (8 * pass)) & 0xFF)];
+    }
+  }
+
+  for (int pass = 0; pass < num_passes; ++pass)
+  {
+    std::size_t* count = &counts[pass * 256];
+    if (n == 0 || count[(keys[0] >> (8 * pass)) & 0xFF] == n)
+    {
+      continue;
+    }
+    std::size_t sum = 0;
+    for (int digit = 0; digit < 256; ++digit)
+    {
+      std::size_t c = count[digit];
+      count[digit] = sum;
+      sum += c;
+    }
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      std::size_t j = count[(keys[i] >> (8 * pass)) & 0xFF]++;
+      keys_next[j] = keys[i];
+      p_next[j] = p[i];
+    }
+    keys.swap(keys_next);
+    p.swap(p_next);
+  }
+  return p;
+}
+
+// Find the permutation required to sort a vector of integers in ascending or
+// descending order (radix sort)
+template <typename T>
+typename enable_if_radix_sortable<T>::type sort_permutation(
+  const std::vector<T>& vec,
+  const std::less<T>&)
+{
+  return radix_sort_permutation(vec, false);
+}
+
 template <typename T>
+typename enable_if_radix_sortable<T>::type sort_permutation(
+  const std::vector<T>& vec,
+  const std::greater<T>&)
+{
+  return radix_sort_permutation(vec, true);
+}
+
+// Apply a permutation to one or more vectors of the same size, walking the
+// cycles of the permutation only once for all of them
+template <typename... T>
 void apply_permutation_in_place(
-  std::vector<T>& vec,
-  const std::vector<std::size_t>& p)
+  const std::vector<std::size_t>& p,
+  std::vector<T>&... vecs)
 {
-  std::vector<bool> done(vec.size());
-  for (std::size_t i = 0; i < vec.size(); ++i)
+  std::vector<bool> done(p.size());
+  for (std::size_t i = 0; i < p.size(); ++i)
   {
     if (done[i])
     {
@@ -36,10 +123,11 @@ void apply_permutation_in_place(
     std::size_t j = p[i];
     while (i != j)
     {
-      std::swap(vec[prev_j], vec[j]);
+      using std::swap;
+      (swap(vecs[prev_j], vecs[j]), ...);
       done[j] = true;
       prev_j = j;
       j = p[j];
     }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "utility.h"
+
+using namespace cv;
+
+// Uniform grid over the rectangles of segments, for finding the segments
+// closest to a rectangle. Every segment is listed in each cell its rectangle
+// overlaps, segments can be removed. Queries search rings of cells around the
+// query until no closer segment can be found in the rings that are left.
+class SpatialGrid {
+public:
+  // Create a grid covering an image, with square cells of the given size
+  SpatialGrid(const Size& image_size, int cell_size)
+    : cell_size_(std::max(cell_size, 1)),
+      columns_(std::max((image_size.width + cell_size_ - 1) / cell_size_, 1)),
+      rows_(std::max((image_size.height + cell_size_ - 1) / cell_size_, 1)),
+      cells_(columns_ * rows_) {}
+
+  // Number of segments in the grid
+  int Size() const { return size_; }
+
+  // Add a segment
+  void Insert(int id, const Rect& rect) {
+    if (id >= rects_.size()) {
+      rects_.resize(id + 1);
+      present_.resize(id + 1, 0);
+      visited_.resize(id + 1, 0);
+    }
+    rects_[id] = rect;
+    present_[id] = 1;
+    size_++;
+    Rect cells = CellRange(rect);
+    for (int y = cells.y; y < cells.y + cells.height; y++) {
+      for (int x = cells.x; x < cells.x + cells.width; x++) { cells_[y * columns_ + x].push_back(id); }
+    }
+  }
+
+  // Remove a segment
+  void Remove(int id) {
+    if (id >= present_.size() || !present_[id]) { return; }
+    present_[id] = 0;
+    size_--;
+    Rect cells = CellRange(rects_[id]);
+    for (int y = cells.y; y < cells.y + cells.height; y++) {
+      for (int x = cells.x; x < cells.x + cells.width; x++) {
+        std::vector<int>& cell = cells_[y * columns_ + x];
+        auto it = std::find(cell.begin(), cell.end(), id);
+        std::swap(*it, cell.back());
+        cell.pop_back();
+      }
+    }
+  }
+
+  // Find up to k segments closest to a rectangle (gap between the rectangles,
+  // ties broken by id), closest first. Segments for which skip(id) is true are
+  // left out.
+  template<typename Skip>
+  void Nearest(const Rect& query, int k, Skip skip, std::vector<int>* out_ids) const {
+    out_ids->clear();
+    if (k <= 0 || size_ == 0) { return; }
+    std::vector<std::pair<int64, int>> found;
+    visit_stamp_++;
+    Rect range = CellRange(query);
+    int max_ring = std::max(std::max(range.x, columns_ - range.x - range.width), std::max(range.y, rows_ - range.y - range.height));
+    for (int ring = 0; ring <= max_ring; ring++) {
+      int x1 = range.x - ring;
+      int y1 = range.y - ring;
+      int x2 = range.x + range.width - 1 + ring;
+      int y2 = range.y + range.height - 1 + ring;
+      // Ring 0 is the cells of the query itself, the other rings only the
+      // border of the cells around the previous ring
+      for (int y = std::max(y1, 0); y <= std::min(y2, rows_ - 1); y++) {
+        bool full_row = (ring == 0 || y == y1 || y == y2);
+        for (int x = std::max(x1, 0); x <= std::min(x2, columns_ - 1); x += (full_row || x == x2) ? 1 : x2 - x) {
+          for (int id : cells_[y * columns_ + x]) {
+            if (visited_[id] == visit_stamp_) { continue; }
+            visited_[id] = visit_stamp_;
+            if (skip(id)) { continue; }
+            found.push_back(std::make_pair(Distance2(query, rects_[id]), id));
+          }
+        }
+      }
+
+      // Segments in the rings further out are at least ring cells away, so the
+      // segments closer than that are final
+      int64 bound = (int64)ring * cell_size_;
+      int final_count = 0;
+      for (int i = 0; i < found.size(); i++) { final_count += found[i].first < bound * bound; }
+      if (final_count >= k) { break; }
+    }
+    std::sort(found.begin(), found.end());
+    for (int i = 0; i < found.size() && i < k; i++) { out_ids->push_back(found[i].second); }
+  }
+
+  // Squared distance between two rectangles (0 if they touch or overlap)
+  static int64 Distance2(const Rect& a, const Rect& b) {
+    int64 dx = std::max(0, std::max(a.x - (b.x + b.width), b.x - (a.x + a.width)));
+    int64 dy = std::max(0, std::max(a.y - (b.y + b.height), b.y - (a.y + a.height)));
+    return dx * dx + dy * dy;
+  }
+
+private:
+  // Range of cells overlapped by a rectangle (clamped to the grid)
+  Rect CellRange(const Rect& rect) const {
+    int x1 = clip(rect.x / cell_size_, 0, columns_ - 1);
+    int y1 = clip(rect.y / cell_size_, 0, rows_ - 1);
+    int x2 = clip((rect.x + std::max(rect.width, 1) - 1) / cell_size_, 0, columns_ - 1);
+    int y2 = clip((rect.y + std::max(rect.height, 1) - 1) / cell_size_, 0, rows_ - 1);
+    return Rect(x1, y1, x2 - x1 + 1, y2 - y1 + 1);
+  }
+
+  int cell_size_;
+  int columns_;
+  int rows_;
+  std::vector<std::vector<int>> cells_;
+  std::vector<Rect> rects_;
+  std::vector<char> present_;
+  int size_ = 0;
+  mutable std::vector<int> visited_;
+  mutable int visit_stamp_ = 0;
+};
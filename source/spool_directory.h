@@ -0,0 +1,152 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <system_error>
+#include <vector>
+#include "image_ingest.h"
+
+using namespace cv;
+
+// Spool directory that pages are dropped into for the daemon mode (e.g. by a
+// scanner). A page is picked up once its size and modification time have not
+// changed between two polls, so pages that are still being written are left
+// alone (writing to a hidden name and renaming also works, hidden files are
+// ignored). Finished pages are moved to done/ or failed/ and every job has a
+// status file in status/ that is replaced atomically on each change.
+
+// State of a job
+enum class JobState {
+  QUEUED,
+  PROCESSING,
+  DONE,
+  FAILED
+};
+
+// Name of a job state
+static const char* JobStateName(JobState state) {
+  switch (state) {
+  case JobState::QUEUED: return "queued";
+  case JobState::PROCESSING: return "processing";
+  case JobState::DONE: return "done";
+  case JobState::FAILED: return "failed";
+  }
+  return "";
+}
+
+// Status of a job, as written to its status file
+struct JobStatus {
+  String file;  // Name of the page in the spool directory
+  JobState state = JobState::QUEUED;
+  uint64 pages = 0;
+  uint64 segments = 0;
+  double queued_ms = 0;      // Time between pickup and start of processing
+  double processing_ms = 0;  // Time from the start of processing until the segments are written
+  String error;
+};
+
+class SpoolDirectory {
+public:
+  // Open a spool directory and create its done/, failed/ and status/
+  // subdirectories. Returns false if it is not a directory.
+  bool Open(const String& directory) {
+    directory_ = directory;
+    std::error_code error;
+    if (!std::filesystem::is_directory(directory_, error)) { return false; }
+    for (const char* subdirectory : { "done", "failed", "status" }) {
+      std::filesystem::create_directories(std::filesystem::path(directory_) / subdirectory, error);
+      if (error) { return false; }
+    }
+    return true;
+  }
+
+  // Path of a page in the spool directory
+  String Path(const String& file) const { return (std::filesystem::path(directory_) / file).string(); }
+
+  // Find the pages that are ready to be processed, in order of name. A page
+  // is returned once, until it is released.
+  void Poll(std::vector<String>* out_files) {
+    out_files->clear();
+    std::map<String, FileState> seen;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(directory_, error)) {
+      String file = entry.path().filename().string();
+      if (file.empty() || file[0] == '.' || !entry.is_regular_file(error) || !IsImageFile(file)) { continue; }
+      FileState state = { entry.file_size(error), entry.last_write_time(error) };
+      if (error) { continue; }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (claimed_.count(file) > 0) { continue; }
+      }
+      auto previous = candidates_.find(file);
+      if (previous != candidates_.end() && previous->second.size == state.size && previous->second.time == state.time) {
+        out_files->push_back(file);
+        std::lock_guard<std::mutex> lock(mutex_);
+        claimed_.insert(file);
+      } else {
+        seen[file] = state;
+      }
+    }
+    candidates_.swap(seen);
+    std::sort(out_files->begin(), out_files->end());
+  }
+
+  // Move a processed page to done/ or failed/ (replacing an earlier page of
+  // the same name), after which a new page of that name can be picked up
+  bool Release(const String& file, bool success) {
+    std::error_code error;
+    std::filesystem::rename(Path(file), std::filesystem::path(directory_) / (success ? "done" : "failed") / file, error);
+    std::lock_guard<std::mutex> lock(mutex_);
+    claimed_.erase(file);
+    return !error;
+  }
+
+  // Write the status file of a job (status/<page>.json). The file is written
+  // under a temporary name and renamed, so readers never see a partial file.
+  bool WriteStatus(const JobStatus& status) const {
+    std::filesystem::path directory = std::filesystem::path(directory_) / "status";
+    std::filesystem::path temporary = directory / ("." + status.file + ".json.tmp");
+    {
+      std::ofstream stream(temporary);
+      stream << std::fixed << std::setprecision(3)
+             << "{\"file\":" << JsonString(status.file) << ",\"state\":\"" << JobStateName(status.state) << "\""
+             << ",\"pages\":" << status.pages << ",\"segments\":" << status.segments
+             << ",\"queued_ms\":" << status.queued_ms << ",\"processing_ms\":" << status.processing_ms
+             << ",\"error\":" << JsonString(status.error) << "}" << std::endl;
+      if (!stream) { return false; }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, directory / (status.file + ".json"), error);
+    return !error;
+  }
+
+private:
+  struct FileState {
+    uintmax_t size;
+    std::filesystem::file_time_type time;
+  };
+
+  // Quote a string for JSON
+  static String JsonString(const String& text) {
+    std::ostringstream quoted;
+    quoted << '"';
+    for (unsigned char c : text) {
+      if (c == '"' || c == '\\') { quoted << '\\' << c; }
+      else if (c < 0x20) { quoted << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec; }
+      else { quoted << c; }
+    }
+    quoted << '"';
+    return quoted.str();
+  }
+
+  String directory_;
+  std::map<String, FileState> candidates_;  // Seen on the last poll, not claimed yet
+  std::set<String> claimed_;                // Picked up and not released yet
+  mutable std::mutex mutex_;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <vector>
+
+using namespace cv;
+
+// Generator of synthetic document pages for benchmarking: lines of text-like
+// glyphs (short connected strokes) on a light background, with noise specks,
+// glyphs touching their neighbour and an illumination gradient. The same
+// settings and seed always give the same page.
+
+// Parameters of a synthetic page
+struct SyntheticPageSettings {
+  Size size;
+  int glyph_height = 32;       // Height of a glyph in pixels (lines are 1.8 glyphs apart)
+  float glyph_density = 0.8f;  // Fraction of the glyph positions on a line that hold a glyph
+  float noise_rate = 50.0f;    // Noise specks per megapixel
+  float touching_rate = 0.05f; // Fraction of glyphs that touch the next glyph
+  float illumination = 0.15f;  // Darkening from the top-left to the bottom-right corner (0 to 1)
+  uint64 seed = 0x5eed;
+};
+
+// Render a synthetic grayscale page. Returns the number of glyphs drawn.
+static int GenerateSyntheticPage(const SyntheticPageSettings& settings, Mat* out_page) {
+  const uchar kPaper = 235;
+  const uchar kInk = 40;
+  RNG rng(settings.seed);
+  out_page->create(settings.size, CV_8U);
+  out_page->setTo(Scalar(kPaper));
+  Mat& page = *out_page;
+
+  // Glyphs: a polyline of 3 to 5 strokes through random points of the glyph
+  // box, so every glyph is a single connected blob
+  int height = std::max(settings.glyph_height, 4);
+  int width = height * 6 / 10;
+  int gap = std::max(height / 4, 2);
+  int thickness = std::max(height / 8, 1);
+  int margin = 2 * height;
+  int num_glyphs = 0;
+  std::vector<Point> strokes;
+  for (int y = margin; y + height <= page.rows - margin; y += height * 18 / 10) {
+    for (int x = margin; x + width <= page.cols - margin; x += width + gap) {
+      if (rng.uniform(0.0f, 1.0f) >= settings.glyph_density) { continue; }
+      int glyph_width = width;
+      if (rng.uniform(0.0f, 1.0f) < settings.touching_rate) { glyph_width += gap + thickness; }
+      strokes.clear();
+      int num_points = rng.uniform(4, 7);
+      for (int i = 0; i < num_points; i++) { strokes.push_back(Point(x + rng.uniform(0, glyph_width), y + rng.uniform(0, height))); }
+      // Touching glyphs reach into the next glyph position
+      if (glyph_width > width) { strokes.push_back(Point(x + glyph_width, y + height / 2)); }
+      const Point* points = strokes.data();
+      int count = (int)strokes.size();
+      polylines(page, &points, &count, 1, false, Scalar(kInk), thickness, LINE_8);
+      num_glyphs++;
+    }
+  }
+
+  // Noise specks of 1 to 3 pixels
+  int64 num_specks = (int64)(settings.noise_rate * page.total() / 1e6);
+  for (int64 i = 0; i < num_specks; i++) {
+    Point center(rng.uniform(0, page.cols), rng.uniform(0, page.rows));
+    circle(page, center, rng.uniform(0, 2), Scalar(kInk), FILLED, LINE_8);
+  }
+
+  // Illumination gradient, the brightness falls linearly along x and y
+  if (settings.illumination > 0) {
+    float step_x = 0.5f * settings.illumination / page.cols;
+    float step_y = 0.5f * settings.illumination / page.rows;
+    for (int y = 0; y < page.rows; y++) {
+      uchar* row = page.ptr<uchar>(y);
+      float brightness = 1.0f - step_y * y;
+      for (int x = 0; x < page.cols; x++) { row[x] = (uchar)(row[x] * (brightness - step_x * x)); }
+    }
+  }
+  return num_glyphs;
+}
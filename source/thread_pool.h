@@ -0,0 +1,144 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a task queue which it drains
+// from the back, idle workers steal from the front of the other queues. This
+// keeps all cores busy even when tasks have very different durations (e.g.
+// pages with a few hundred versus tens of thousands of segments).
+class ThreadPool {
+public:
+  // Create a pool with the given number of workers (0 uses all cores)
+  explicit ThreadPool(unsigned int num_threads = 0) {
+    if (num_threads == 0) { num_threads = std::thread::hardware_concurrency(); }
+    if (num_threads == 0) { num_threads = 1; }
+    for (unsigned int i = 0; i < num_threads; i++) { queues_.emplace_back(new WorkerQueue()); }
+    for (unsigned int i = 0; i < num_threads; i++) { workers_.emplace_back(&ThreadPool::WorkerLoop, this, i); }
+  }
+
+  // Finish all submitted tasks and join the workers
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (int i = 0; i < workers_.size(); i++) { workers_[i].join(); }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Number of worker threads
+  unsigned int NumThreads() const { return (unsigned int)workers_.size(); }
+
+  // Submit a task. Tasks submitted from a worker go to that worker's own
+  // queue (good locality), others are distributed round-robin.
+  void Submit(std::function<void()> task) {
+    unsigned int i = (CurrentPool() == this) ? CurrentWorker() : (next_queue_++ % queues_.size());
+    unfinished_++;
+    {
+      std::lock_guard<std::mutex> lock(queues_[i]->mutex);
+      queues_[i]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_++;
+    }
+    wake_.notify_one();
+  }
+
+  // Block until all submitted tasks have finished. Rethrows the first
+  // exception thrown by a task, if any.
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return unfinished_ == 0; });
+    if (exception_) {
+      std::exception_ptr exception = exception_;
+      exception_ = nullptr;
+      std::rethrow_exception(exception);
+    }
+  }
+
+  // Index of the worker running the calling thread (0 outside of a pool)
+  static unsigned int CurrentWorker() { return CurrentWorkerSlot(); }
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  static ThreadPool*& CurrentPool() { thread_local ThreadPool* pool = nullptr; return pool; }
+  static unsigned int& CurrentWorkerSlot() { thread_local unsigned int worker = 0; return worker; }
+
+  // Pop a task from the back of the own queue, or steal one from the front of
+  // another worker's queue
+  bool TryTake(unsigned int i, std::function<void()>* out_task) {
+    {
+      std::lock_guard<std::mutex> lock(queues_[i]->mutex);
+      if (!queues_[i]->tasks.empty()) {
+        *out_task = std::move(queues_[i]->tasks.back());
+        queues_[i]->tasks.pop_back();
+        return true;
+      }
+    }
+    for (unsigned int k = 1; k < queues_.size(); k++) {
+      WorkerQueue& victim = *queues_[(i + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        *out_task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerLoop(unsigned int i) {
+    CurrentPool() = this;
+    CurrentWorkerSlot() = i;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (queued_ == 0) { return; } // Stopping and nothing left to do
+        queued_--;
+      }
+
+      // A task is guaranteed to be queued somewhere, keep looking until it is
+      // found (another worker may be moving it around)
+      std::function<void()> task;
+      while (!TryTake(i, &task)) { std::this_thread::yield(); }
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!exception_) { exception_ = std::current_exception(); }
+      }
+
+      if (--unfinished_ == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  size_t queued_ = 0;
+  std::atomic<size_t> unfinished_{ 0 };
+  std::atomic<unsigned int> next_queue_{ 0 };
+  std::exception_ptr exception_;
+  bool stop_ = false;
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include "adaptive_threshold.h"
+#include "segmentation.h"
+
+using namespace cv;
+
+// Interactive thresholding of large images. The image is reduced once to a
+// pyramid level that fits on screen and only that level is thresholded while
+// the slider moves. Statistics are read from a cumulative histogram of the
+// full-resolution image, so they are exact and take constant time per step.
+// The full-resolution mask is only computed once the threshold is confirmed.
+// The preview can also start from an image decoded at reduced resolution, the
+// statistics then follow once the full-resolution image is there.
+class ThresholdPreview {
+public:
+  // Prepare the preview of an 8-bit grayscale image. The preview is halved
+  // until its longest side is at most max_size pixels.
+  void Build(const Mat& image, int max_size = 2048) {
+    SetFullResolution(image);
+    BuildLevel(image, 1, max_size);
+  }
+
+  // Prepare the preview from an image at 1/scale of the full resolution.
+  // Until SetFullResolution() is called there are no statistics, and Otsu's
+  // threshold is estimated on the reduced image.
+  void BuildReduced(const Mat& reduced_image, int scale, int max_size = 2048) {
+    std::vector<uint64> histogram(256, 0);
+    AccumulateHistogram(reduced_image, &histogram);
+    otsu_threshold_ = ComputeOtsuThreshold(histogram);
+    cumulative_histogram_.clear();
+    BuildLevel(reduced_image, scale, max_size);
+  }
+
+  // Compute the statistics (and Otsu's threshold) of the full-resolution image
+  void SetFullResolution(const Mat& image) {
+    std::vector<uint64> histogram(256, 0);
+    AccumulateHistogram(image, &histogram);
+    otsu_threshold_ = ComputeOtsuThreshold(histogram);
+    cumulative_histogram_.resize(256);
+    uint64 sum = 0;
+    for (int i = 0; i < 256; i++) {
+      sum += histogram[i];
+      cumulative_histogram_[i] = sum;
+    }
+  }
+
+  // Whether the statistics of the full-resolution image are known
+  bool HasStatistics() const { return !cumulative_histogram_.empty(); }
+
+  // Threshold picked by Otsu's method on the full-resolution histogram
+  int OtsuThreshold() const { return otsu_threshold_; }
+
+  // Downscale factor of the preview
+  int Scale() const { return scale_; }
+
+  // Number of full-resolution pixels that become foreground (black) at a
+  // threshold, i.e. have a value of at most t
+  uint64 ForegroundPixels(int t) const { return (t < 0 || !HasStatistics()) ? 0 : cumulative_histogram_[std::min(t, 255)]; }
+
+  // Fraction of the full-resolution pixels that become foreground at a threshold
+  double ForegroundFraction(int t) const { return (!HasStatistics() || cumulative_histogram_.back() == 0) ? 0.0 : (double)ForegroundPixels(t) / cumulative_histogram_.back(); }
+
+  // Render the thresholded preview with the statistics of the threshold
+  void Render(int t, Mat* out_preview) const {
+    threshold(level_, *out_preview, t, 255, THRESH_BINARY);
+    std::ostringstream text;
+    if (HasStatistics()) {
+      text << "t=" << t << "  foreground " << std::fixed << std::setprecision(2) << 100.0 * ForegroundFraction(t) << "% (" << ForegroundPixels(t) << " px)"
+           << "  otsu " << otsu_threshold_ << "  preview 1/" << scale_;
+    } else {
+      text << "t=" << t << "  foreground ... (loading full image)  otsu ~" << otsu_threshold_ << "  preview 1/" << scale_;
+    }
+    DrawStatistics(text.str(), out_preview);
+  }
+
+  // Render the preview of local thresholding. The window is scaled down with
+  // the preview, the foreground fraction is measured on the preview.
+  void RenderAdaptive(ThresholdMode mode, int window_size, double k, Mat* out_preview) const {
+    PerformAdaptiveThresholding(level_, mode, std::max(window_size / scale_, 3) | 1, k, out_preview);
+    double foreground = 1.0 - (double)countNonZero(*out_preview) / std::max<size_t>(out_preview->total(), 1);
+    std::ostringstream text;
+    text << "k=" << std::fixed << std::setprecision(2) << k << "  foreground ~" << 100.0 * foreground << "%  preview 1/" << scale_;
+    DrawStatistics(text.str(), out_preview);
+  }
+
+private:
+  // Halve an image at 1/scale of the full resolution until its longest side
+  // is at most max_size pixels, and keep it as the preview level
+  void BuildLevel(const Mat& image, int scale, int max_size) {
+    level_ = image;
+    scale_ = scale;
+    while (std::max(level_.cols, level_.rows) > max_size) {
+      pyrDown(level_, level_);
+      scale_ *= 2;
+    }
+  }
+
+  // Draw a line of statistics on a white banner at the top of the preview
+  static void DrawStatistics(const String& text, Mat* out_preview) {
+    double font_scale = std::max(0.5, out_preview->cols / 1600.0);
+    int baseline = 0;
+    Size size = getTextSize(text, FONT_HERSHEY_SIMPLEX, font_scale, 1, &baseline);
+    rectangle(*out_preview, Rect(0, 0, std::min(out_preview->cols, size.width + 10), size.height + baseline + 10), Scalar(255), FILLED);
+    putText(*out_preview, text, Point(5, size.height + 5), FONT_HERSHEY_SIMPLEX, font_scale, Scalar(0), 1, LINE_AA);
+  }
+
+  Mat level_;
+  int scale_ = 1;
+  int otsu_threshold_ = 0;
+  std::vector<uint64> cumulative_histogram_;
+};
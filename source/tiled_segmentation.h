@@ -0,0 +1,487 @@
+#pragma once
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+#include "connected_components.h"
+#include "image_ingest.h"
+#include "segmentation.h"
+
+using namespace cv;
+
+// Bounded-memory segmentation for very large scans. The image is read,
+// thresholded and labeled in strips of full-width rows. Components that cross
+// the seam between two strips are stitched with a small union-find over the
+// border rows. A segment is finished once it does not touch the last row read
+// (no later strip can extend it) and is emitted once the rows of its bottom
+// crop margin are read, so crops match those of the whole page. Only the last
+// few strips are kept in memory, so peak memory is set by the strip size
+// instead of the page. A segment whose crop starts above the retained strips
+// is cropped from rows read again, and emitted segments are dropped from the
+// union-find, so its size is set by the open segments instead of all
+// components of the page.
+// Binary PGM files and (with libtiff) strip-organized TIFF pages are streamed
+// from disk, other formats are decoded in full.
+
+// Source of image rows, read top to bottom as 8-bit grayscale
+class StripReader {
+public:
+  virtual ~StripReader() {}
+  virtual int Width() const = 0;
+  virtual int Height() const = 0;
+
+  // Read rows [y, y + count) into out_rows. Rows are mostly read in order,
+  // earlier rows are read again to crop tall segments.
+  virtual bool ReadRows(int y, int count, Mat* out_rows) = 0;
+
+  // Go back to the first row
+  virtual bool Rewind() = 0;
+};
+
+// Streams rows of a binary 8-bit PGM (P5) file straight from disk
+class PgmStripReader : public StripReader {
+public:
+  // Open a PGM file, returns false if it is not an 8-bit binary PGM
+  bool Open(const String& file) {
+    file_.open(file, std::ios::binary);
+    String magic;
+    int maxval = 0;
+    if (!(file_ >> magic) || magic != "P5") { return false; }
+    if (!ReadHeaderValue(&width_) || !ReadHeaderValue(&height_) || !ReadHeaderValue(&maxval)) { return false; }
+    if (maxval <= 0 || maxval > 255) { return false; }
+    file_.get(); // Single whitespace before the pixel data
+    data_offset_ = file_.tellg();
+    return file_.good();
+  }
+
+  int Width() const override { return width_; }
+  int Height() const override { return height_; }
+
+  bool ReadRows(int y, int count, Mat* out_rows) override {
+    out_rows->create(count, width_, CV_8U);
+    file_.seekg(data_offset_ + (std::streamoff)y * width_);
+    for (int i = 0; i < count; i++) { file_.read((char*)out_rows->ptr<uchar>(i), width_); }
+    return file_.good();
+  }
+
+  bool Rewind() override {
+    file_.clear();
+    file_.seekg(data_offset_);
+    return file_.good();
+  }
+
+private:
+  // Read a header value, skipping whitespace and comments
+  bool ReadHeaderValue(int* out_value) {
+    file_ >> std::ws;
+    while (file_.peek() == '#') {
+      String comment;
+      std::getline(file_, comment);
+      file_ >> std::ws;
+    }
+    return (bool)(file_ >> *out_value);
+  }
+
+  std::ifstream file_;
+  std::streamoff data_offset_ = 0;
+  int width_ = 0;
+  int height_ = 0;
+};
+
+#ifdef HAVE_LIBTIFF
+// Streams rows of a TIFF page with libtiff scanline access. Supports the
+// strip-organized pages scans come as: 1- or 8-bit gray and 8-bit RGB(A).
+// libtiff restarts the strip when earlier rows are read again.
+class TiffStripReader : public StripReader {
+public:
+  ~TiffStripReader() {
+    if (tiff_ != nullptr) { TIFFClose(tiff_); }
+  }
+
+  // Open a page of a TIFF file, returns false if it is not a TIFF or the
+  // page cannot be streamed
+  bool Open(const String& file, int page) {
+    tiff_ = TIFFOpen(file.c_str(), "r");
+    if (tiff_ == nullptr || !TIFFSetDirectory(tiff_, (tdir_t)page) || TIFFIsTiled(tiff_)) { return false; }
+    uint32_t width = 0, height = 0;
+    uint16_t bits = 1, samples = 1, planar = PLANARCONFIG_CONTIG, orientation = ORIENTATION_TOPLEFT;
+    if (!TIFFGetField(tiff_, TIFFTAG_IMAGEWIDTH, &width) || !TIFFGetField(tiff_, TIFFTAG_IMAGELENGTH, &height)) { return false; }
+    if (!TIFFGetField(tiff_, TIFFTAG_PHOTOMETRIC, &photometric_)) { return false; }
+    TIFFGetFieldDefaulted(tiff_, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetFieldDefaulted(tiff_, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted(tiff_, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(tiff_, TIFFTAG_ORIENTATION, &orientation);
+    bool gray = (photometric_ == PHOTOMETRIC_MINISBLACK || photometric_ == PHOTOMETRIC_MINISWHITE) && samples == 1 && (bits == 1 || bits == 8);
+    bool rgb = photometric_ == PHOTOMETRIC_RGB && (samples == 3 || samples == 4) && bits == 8 && planar == PLANARCONFIG_CONTIG;
+    if ((!gray && !rgb) || orientation != ORIENTATION_TOPLEFT || width > INT_MAX || height > INT_MAX) { return false; }
+    width_ = (int)width;
+    height_ = (int)height;
+    bits_ = bits;
+    samples_ = samples;
+    scanline_.resize(TIFFScanlineSize(tiff_));
+    return true;
+  }
+
+  int Width() const override { return width_; }
+  int Height() const override { return height_; }
+
+  bool ReadRows(int y, int count, Mat* out_rows) override {
+    out_rows->create(count, width_, CV_8U);
+    for (int i = 0; i < count; i++) {
+      if (TIFFReadScanline(tiff_, scanline_.data(), (uint32_t)(y + i), 0) < 0) { return false; }
+      ConvertScanline(out_rows->ptr<uchar>(i));
+    }
+    return true;
+  }
+
+  bool Rewind() override { return true; }
+
+private:
+  // Convert the current scanline to 8-bit gray (black is 0, like imread)
+  void ConvertScanline(uchar* row) const {
+    const uchar* scanline = scanline_.data();
+    uchar invert = photometric_ == PHOTOMETRIC_MINISWHITE ? 255 : 0;
+    if (samples_ > 1) {
+      // Same weights as the RGB to gray conversion of OpenCV
+      for (int x = 0; x < width_; x++, scanline += samples_) { row[x] = (uchar)((scanline[0] * 4899 + scanline[1] * 9617 + scanline[2] * 1868 + 8192) >> 14); }
+    } else if (bits_ == 1) {
+      for (int x = 0; x < width_; x++) { row[x] = (uchar)(((scanline[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0) ^ invert); }
+    } else {
+      for (int x = 0; x < width_; x++) { row[x] = (uchar)(scanline[x] ^ invert); }
+    }
+  }
+
+  TIFF* tiff_ = nullptr;
+  int width_ = 0;
+  int height_ = 0;
+  uint16_t photometric_ = PHOTOMETRIC_MINISBLACK;
+  uint16_t bits_ = 8;
+  uint16_t samples_ = 1;
+  std::vector<uchar> scanline_;
+};
+#endif
+
+// Serves rows of a page decoded in full (for pages that cannot be streamed)
+class DecodedStripReader : public StripReader {
+public:
+  explicit DecodedStripReader(const Mat& gray) : image_(gray) {}
+
+  int Width() const override { return image_.cols; }
+  int Height() const override { return image_.rows; }
+
+  bool ReadRows(int y, int count, Mat* out_rows) override {
+    *out_rows = image_.rowRange(y, y + count);
+    return true;
+  }
+
+  bool Rewind() override { return true; }
+
+private:
+  Mat image_;
+};
+
+// Open a strip reader streaming a page of an image file from disk. Returns
+// nullptr if the page cannot be streamed (it has to be decoded in full).
+static std::unique_ptr<StripReader> OpenStripReader(const String& file, int page) {
+  if (page == 0) {
+    std::unique_ptr<PgmStripReader> pgm_reader(new PgmStripReader());
+    if (pgm_reader->Open(file)) { return pgm_reader; }
+  }
+#ifdef HAVE_LIBTIFF
+  if (HasExtension(file, { ".tif", ".tiff" })) {
+    std::unique_ptr<TiffStripReader> tiff_reader(new TiffStripReader());
+    if (tiff_reader->Open(file, page)) { return tiff_reader; }
+  }
+#endif
+  return nullptr;
+}
+
+// Segment found by the tiled segmenter
+struct TiledSegment {
+  Rect bounding_rectangle;
+  uint area;
+  Rect crop_rectangle;
+  Mat crop; // Grayscale crop, white outside the segment
+};
+
+// Streaming segmenter, fed strip by strip from top to bottom. The given number
+// of strips (at least 2) is retained for cropping segments that span strips,
+// taller segments are cropped from rows read again from the reader.
+class TiledSegmenter {
+public:
+  typedef std::function<void(const TiledSegment&)> SegmentCallback;
+
+  TiledSegmenter(StripReader* reader, int threshold, uint min_area, int margin, int retained_strips, SegmentCallback callback)
+    : reader_(reader), width_(reader->Width()), height_(reader->Height()), threshold_(threshold), min_area_(min_area), margin_(margin), retained_strips_(retained_strips), callback_(callback) {}
+
+  // Process the next strip of full-width grayscale rows. Returns false if the
+  // rows of a tall segment could not be read again.
+  bool PushStrip(const Mat& rows) {
+    CV_Assert(rows.cols == width_ && next_row_ + rows.rows <= height_);
+
+    // Recycle the buffers of the oldest strip once enough strips are retained
+    // (the previous strip is always kept for stitching)
+    Strip strip;
+    if (strips_.size() > 1 && strips_.size() >= retained_strips_) {
+      strip = std::move(strips_.front());
+      strips_.pop_front();
+    }
+    strip.y = next_row_;
+    rows.copyTo(strip.gray);
+    PerformThresholding(strip.gray, threshold_, &mask_);
+    LabelConnectedComponents(mask_, &components_, &strip.labels);
+
+    // Every component of the strip gets a global id and a seed pixel (the
+    // first pixel of its top row) to find it again in rows read again
+    strip.globals.resize(components_.areas.size());
+    for (int i = 0; i < components_.areas.size(); i++) {
+      const Rect& r = components_.bounding_rectangles[i];
+      const int* labels = strip.labels.ptr<int>(r.y);
+      int x = r.x;
+      while (labels[x] != i + 1) { x++; }
+      strip.globals[i] = (int)parents_.size();
+      parents_.push_back(strip.globals[i]);
+      areas_.push_back(components_.areas[i]);
+      bounding_rectangles_.push_back(r + Point(0, strip.y));
+      seeds_.push_back(Point(x, strip.y + r.y));
+    }
+
+    // Stitch the components touching the seam with the previous strip
+    if (!strips_.empty() && strips_.back().y + strips_.back().labels.rows == strip.y) {
+      const Strip& previous = strips_.back();
+      const int* above = previous.labels.ptr<int>(previous.labels.rows - 1);
+      const int* below = strip.labels.ptr<int>(0);
+      for (int x = 0; x < width_; x++) {
+        if (below[x] == 0) { continue; }
+        for (int dx = -1; dx <= 1; dx++) {
+          if (x + dx < 0 || x + dx >= width_ || above[x + dx] == 0) { continue; }
+          Unite(strip.globals[below[x] - 1], previous.globals[above[x + dx] - 1]);
+        }
+      }
+    }
+    next_row_ += rows.rows;
+    strips_.push_back(std::move(strip));
+
+    // Segments that do not reach the last row are complete
+    std::vector<int> candidates(open_);
+    for (int i = 0; i < strips_.back().globals.size(); i++) { candidates.push_back(strips_.back().globals[i]); }
+    std::vector<int> touching;
+    const int* last_row = strips_.back().labels.ptr<int>(strips_.back().labels.rows - 1);
+    for (int x = 0; x < width_; x++) {
+      if (last_row[x] != 0) { touching.push_back(Find(strips_.back().globals[last_row[x] - 1])); }
+    }
+    Normalize(&candidates);
+    Normalize(&touching);
+    std::vector<int> finished;
+    std::set_difference(candidates.begin(), candidates.end(), touching.begin(), touching.end(), std::back_inserter(finished));
+    open_.swap(touching);
+
+    // Finished segments wait until the rows of their bottom margin are read
+    pending_.insert(pending_.end(), finished.begin(), finished.end());
+    std::vector<int> ready;
+    std::vector<int> waiting;
+    for (int root : pending_) {
+      const Rect& r = bounding_rectangles_[root];
+      (r.y + r.height + margin_ <= next_row_ ? ready : waiting).push_back(root);
+    }
+    pending_.swap(waiting);
+    std::sort(ready.begin(), ready.end());
+    if (!Emit(ready)) { return false; }
+    Compact();
+    return true;
+  }
+
+  // Emit the remaining segments (after the last strip)
+  bool Finish() {
+    std::vector<int> finished(open_);
+    finished.insert(finished.end(), pending_.begin(), pending_.end());
+    Normalize(&finished);
+    open_.clear();
+    pending_.clear();
+    return Emit(finished);
+  }
+
+private:
+  struct Strip {
+    int y = 0;
+    Mat gray;
+    Mat labels;
+    std::vector<int> globals;
+  };
+
+  int Find(int id) {
+    while (parents_[id] != id) {
+      parents_[id] = parents_[parents_[id]];
+      id = parents_[id];
+    }
+    return id;
+  }
+
+  // Join two segments, the statistics are kept by the root
+  void Unite(int a, int b) {
+    a = Find(a);
+    b = Find(b);
+    if (a == b) { return; }
+    if (b < a) { std::swap(a, b); }
+    parents_[b] = a;
+    areas_[a] += areas_[b];
+    bounding_rectangles_[a] |= bounding_rectangles_[b];
+  }
+
+  // Drop the emitted segments from the union-find. Only the open and pending
+  // segments are kept, each under a single id that the retained strips are
+  // remapped to (components of emitted segments get -1).
+  void Compact() {
+    std::vector<int> kept(open_);
+    kept.insert(kept.end(), pending_.begin(), pending_.end());
+    std::vector<int> remap(parents_.size(), -1);
+    for (int i = 0; i < kept.size(); i++) { remap[kept[i]] = i; }
+    for (Strip& strip : strips_) {
+      for (int& id : strip.globals) { id = id < 0 ? -1 : remap[Find(id)]; }
+    }
+    int n = (int)kept.size();
+    std::vector<uint> areas(n);
+    std::vector<Rect> bounding_rectangles(n);
+    std::vector<Point> seeds(n);
+    for (int i = 0; i < n; i++) {
+      areas[i] = areas_[kept[i]];
+      bounding_rectangles[i] = bounding_rectangles_[kept[i]];
+      seeds[i] = seeds_[kept[i]];
+    }
+    for (int i = 0; i < open_.size(); i++) { open_[i] = i; }
+    for (int i = 0; i < pending_.size(); i++) { pending_[i] = (int)open_.size() + i; }
+    parents_.resize(n);
+    for (int i = 0; i < n; i++) { parents_[i] = i; }
+    areas_.swap(areas);
+    bounding_rectangles_.swap(bounding_rectangles);
+    seeds_.swap(seeds);
+  }
+
+  // Map ids to their roots, sorted and without duplicates
+  void Normalize(std::vector<int>* ids) {
+    for (int i = 0; i < ids->size(); i++) { (*ids)[i] = Find((*ids)[i]); }
+    std::sort(ids->begin(), ids->end());
+    ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
+  }
+
+  // Crop and emit finished segments. Returns false if the rows of a tall
+  // segment could not be read again.
+  bool Emit(const std::vector<int>& roots) {
+    if (roots.empty()) { return true; }
+
+    // Resolve the roots of the components in the retained strips once
+    std::vector<std::vector<int>> strip_roots(strips_.size());
+    for (int s = 0; s < strips_.size(); s++) {
+      strip_roots[s].resize(strips_[s].globals.size());
+      for (int i = 0; i < strips_[s].globals.size(); i++) {
+        int id = strips_[s].globals[i];
+        strip_roots[s][i] = id < 0 ? -1 : Find(id);
+      }
+    }
+
+    int retained_y = strips_.front().y;
+    for (int i = 0; i < roots.size(); i++) {
+      int root = roots[i];
+      if (areas_[root] < min_area_) { continue; }
+      TiledSegment segment;
+      segment.bounding_rectangle = bounding_rectangles_[root];
+      segment.area = areas_[root];
+      const Rect& r = segment.bounding_rectangle;
+      int x1 = std::max(r.x - margin_, 0);
+      int x2 = std::min(r.x + r.width + margin_, width_);
+      int y1 = std::max(r.y - margin_, 0);
+      int y2 = std::min(r.y + r.height + margin_, next_row_);
+      if (y1 < retained_y) {
+        // Read the rows of the crop again and label them, the segment is the
+        // component at its seed pixel
+        if (!reader_->ReadRows(y1, y2 - y1, &reread_gray_)) { return false; }
+        Mat gray = reread_gray_.colRange(x1, x2);
+        PerformThresholding(gray, threshold_, &mask_);
+        LabelConnectedComponents(mask_, &components_, &reread_labels_);
+        int label = reread_labels_.at<int>(seeds_[root].y - y1, seeds_[root].x - x1);
+        segment.crop_rectangle = Rect(x1, y1, x2 - x1, y2 - y1);
+        segment.crop.create(y2 - y1, x2 - x1, CV_8U);
+        segment.crop.setTo(Scalar(255));
+        for (int y = 0; y < segment.crop.rows; y++) {
+          const int* labels = reread_labels_.ptr<int>(y);
+          const uchar* source = gray.ptr<uchar>(y);
+          uchar* crop = segment.crop.ptr<uchar>(y);
+          for (int x = 0; x < segment.crop.cols; x++) {
+            if (labels[x] == label) { crop[x] = source[x]; }
+          }
+        }
+      } else {
+        segment.crop_rectangle = Rect(x1, y1, x2 - x1, y2 - y1);
+        segment.crop.create(y2 - y1, x2 - x1, CV_8U);
+        segment.crop.setTo(Scalar(255));
+        for (int s = 0; s < strips_.size(); s++) {
+          const Strip& strip = strips_[s];
+          int y_begin = std::max(y1, strip.y);
+          int y_end = std::min(y2, strip.y + strip.labels.rows);
+          for (int y = y_begin; y < y_end; y++) {
+            const int* labels = strip.labels.ptr<int>(y - strip.y);
+            const uchar* gray = strip.gray.ptr<uchar>(y - strip.y);
+            uchar* crop = segment.crop.ptr<uchar>(y - y1);
+            for (int x = x1; x < x2; x++) {
+              if (labels[x] != 0 && strip_roots[s][labels[x] - 1] == root) { crop[x - x1] = gray[x]; }
+            }
+          }
+        }
+      }
+      callback_(segment);
+    }
+    return true;
+  }
+
+  StripReader* reader_;
+  int width_;
+  int height_;
+  int threshold_;
+  uint min_area_;
+  int margin_;
+  int retained_strips_;
+  SegmentCallback callback_;
+  int next_row_ = 0;
+  std::deque<Strip> strips_;
+  Mat mask_;
+  ConnectedComponents components_;
+  std::vector<int> parents_;
+  std::vector<uint> areas_;
+  std::vector<Rect> bounding_rectangles_;
+  std::vector<Point> seeds_;
+  std::vector<int> open_;
+  std::vector<int> pending_;  // Finished, waiting for the rows of their bottom margin
+  Mat reread_gray_;
+  Mat reread_labels_;
+};
+
+// Segment an image strip by strip. A negative threshold is selected with
+// Otsu's method over a histogram gathered in a first streaming pass.
+static bool PerformTiledSegmentation(StripReader* reader, int strip_height, int t, uint min_area, int margin, int retained_strips, TiledSegmenter::SegmentCallback callback) {
+  Mat rows;
+  if (t < 0) {
+    std::vector<uint64> histogram(256, 0);
+    for (int y = 0; y < reader->Height(); y += strip_height) {
+      int count = std::min(strip_height, reader->Height() - y);
+      if (!reader->ReadRows(y, count, &rows)) { return false; }
+      AccumulateHistogram(rows, &histogram);
+    }
+    t = ComputeOtsuThreshold(histogram);
+    if (!reader->Rewind()) { return false; }
+  }
+
+  TiledSegmenter segmenter(reader, t, min_area, margin, retained_strips, callback);
+  for (int y = 0; y < reader->Height(); y += strip_height) {
+    int count = std::min(strip_height, reader->Height() - y);
+    if (!reader->ReadRows(y, count, &rows) || !segmenter.PushStrip(rows)) { return false; }
+  }
+  return segmenter.Finish();
+}
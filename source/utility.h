@@ -1,4 +1,5 @@
-#include "opencv2\opencv.hpp"
+#pragma once
+#include "opencv2/opencv.hpp"
 
 using namespace cv;
 